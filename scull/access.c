@@ -18,6 +18,8 @@
 #include <linux/tty.h>
 #include <linux/atomic.h>
 #include <linux/list.h>
+#include <linux/rwsem.h>
+#include <linux/mutex.h>
 #include <linux/cred.h>
 #include <linux/sched/signal.h>
 
@@ -74,8 +76,9 @@ static int scull_s_release(struct inode *inode, struct file *filp)
 struct file_operations scull_sngl_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek = 	scull_llseek,
-	.read =		scull_read,
-	.write = 	scull_write,
+	.read_iter = 	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.unlocked_ioctl = scull_ioctl,
 	.compat_ioctl =	scull_ioctl,
 	.open =		scull_s_open,
 	.release = 	scull_s_release,
@@ -115,10 +118,10 @@ static int scull_u_open(struct inode *inode, struct file *filp)
 
 	/* then, everything else is copied from the bare scull device */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (scull_down_write(dev))
 			return -ERESTARTSYS;
 		scull_trim(dev);
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 
 	filp->private_data = dev;
@@ -139,8 +142,9 @@ static int scull_u_release(struct inode *inode, struct file *filp)
 struct file_operations scull_user_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek = 	scull_llseek,
-	.read = 	scull_read,
-	.write = 	scull_write,
+	.read_iter = 	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.unlocked_ioctl = scull_ioctl,
 	.compat_ioctl = scull_ioctl,
 	.open = 	scull_u_open,
 	.release = 	scull_u_release,
@@ -186,10 +190,10 @@ static int scull_w_open(struct inode *indoe, struct file *filp)
 
 	/* then, everything else is copied from the bare scull device */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (scull_down_write(dev))
 			return -ERESTARTSYS;
 		scull_trim(dev);
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 
 	filp->private_data = dev;
@@ -216,8 +220,9 @@ static int scull_w_release(struct inode *inode, struct file *filp)
 struct file_operations scull_wusr_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek = 	scull_llseek,
-	.read = 	scull_read,
-	.write = 	scull_write,
+	.read_iter = 	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.unlocked_ioctl = scull_ioctl,
 	.compat_ioctl = scull_ioctl,
 	.open = 	scull_w_open,
 	.release = 	scull_w_release,
@@ -238,9 +243,12 @@ struct scull_listitem {
 	struct list_head list;
 };
 
-/* The list of devices, and a lock to protect it */
+/*
+ * The list of devices, and a lock to protect it; a mutex, because
+ * new devices are set up with the lock held.
+ */
 static LIST_HEAD(scull_c_list);
-static DEFINE_SPINLOCK(scull_c_lock);
+static DEFINE_MUTEX(scull_c_lock);
 
 /* A placeholder scull_dev which really just holds the cdev stuff */
 static struct scull_dev scull_c_device;
@@ -249,6 +257,7 @@ static struct scull_dev scull_c_device;
 static struct scull_dev *scull_c_lookfor_device(dev_t key)
 {
 	struct scull_listitem *lptr;
+	char name[24];
 
 	list_for_each_entry(lptr, &scull_c_list, list) {
 		if (lptr->key == key)
@@ -263,8 +272,13 @@ static struct scull_dev *scull_c_lookfor_device(dev_t key)
 	/* initialize the device */
 	memset(lptr, 0, sizeof(struct scull_listitem));
 	lptr->key = key;
-	scull_trim(&lptr->device);	/* initialize it */
-	sema_init(&lptr->device.sem, 1);
+	lptr->device.quantum = scull_quantum;	/* initialize it */
+	lptr->device.qset = scull_qset;
+	init_rwsem(&lptr->device.sem);
+	snprintf(name, sizeof(name), "scullpriv-%x", key);
+	if (scull_stats_register(&lptr->device, name))	/* the device works without */
+		printk(KERN_NOTICE "scull: no statistics for %s\n", name);
+	scull_mem_register(&lptr->device);
 
 	/* place it in the list */
 	list_add(&lptr->list, &scull_c_list);
@@ -284,19 +298,19 @@ static int scull_c_open(struct inode *inode, struct file *filp)
 	key = tty_devnum(current->signal->tty);
 	
 	/* look for a scullc device in the list */
-	spin_lock(&scull_c_lock);
+	mutex_lock(&scull_c_lock);
 	dev = scull_c_lookfor_device(key);
-	spin_unlock(&scull_c_lock);
+	mutex_unlock(&scull_c_lock);
 
 	if (!dev)
 		return -ENOMEM;
 
 	/* then, everything else is copied from the bare scull device */
 	if ((filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (scull_down_write(dev))
 			return -ERESTARTSYS;
 		scull_trim(dev);
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 	filp->private_data = dev;
 	return 0;	/* success */
@@ -317,8 +331,9 @@ static int scull_c_release(struct inode *inode, struct file *filp)
 struct file_operations scull_priv_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek = 	scull_llseek,
-	.read = 	scull_read,
-	.write = 	scull_write,
+	.read_iter = 	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.unlocked_ioctl = scull_ioctl,
 	.compat_ioctl = scull_ioctl,
 	.open = 	scull_c_open,
 	.release = 	scull_c_release,
@@ -354,12 +369,15 @@ static void scull_access_setup (dev_t devno, struct scull_adev_info *devinfo)
 	/* Initialize the device structure */
 	dev->quantum = scull_quantum;
 	dev->qset = scull_qset;
-	sema_init(&dev->sem, 1);
+	init_rwsem(&dev->sem);
+	scull_mem_register(dev);
 
 	/* Do the cdev stuff */
 	cdev_init(&dev->cdev, devinfo->fops);
 	kobject_set_name(&dev->cdev.kobj, devinfo->name);
 	dev->cdev.owner = THIS_MODULE;
+	if (scull_stats_register(dev, devinfo->name))	/* the device works without */
+		printk(KERN_NOTICE "scull: no statistics for %s\n", devinfo->name);
 	err = cdev_add(&dev->cdev, devno, 1);
 	/* Fail gracefully if need be */
 	if (err) {
@@ -405,12 +423,18 @@ void scull_access_cleanup(void)
 		struct scull_dev *dev = scull_access_devs[i].sculldev;
 		cdev_del(&dev->cdev);
 		scull_trim(scull_access_devs[i].sculldev);
+		scull_drain_pools(scull_access_devs[i].sculldev);
+		scull_stats_unregister(dev);
+		scull_mem_unregister(dev);
 	}
 
 	/* And all the cloned devices */
 	list_for_each_entry_safe(lptr, next, &scull_c_list, list) {
 		list_del(&lptr->list);
 		scull_trim(&lptr->device);
+		scull_drain_pools(&lptr->device);
+		scull_stats_unregister(&lptr->device);
+		scull_mem_unregister(&lptr->device);
 		kfree(lptr);
 	}
 
@@ -0,0 +1,127 @@
+/*
+ * compress.c -- the compressed tier of the bare scull devices
+ *
+ * When scull_cold_secs is set, a background worker goes over all the
+ * devices every now and then, and compresses with LZ4 the quanta that
+ * were not touched for that many seconds. Reading a cold quantum
+ * decompresses it on the fly; writing to it, or reading it again
+ * before the next pass of the worker, brings it back to the hot tier.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/crypto.h>
+#include <linux/err.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+int scull_cold_secs = 0;	/* idle time before compression, 0 for never */
+module_param(scull_cold_secs, int, S_IRUGO | S_IWUSR);
+
+/*
+ * A compression transform can't be used by two callers at a time, and
+ * there is little point in having more than one: only the worker
+ * compresses, and only readers of cold data decompress.
+ */
+static struct crypto_comp *scull_tfm;
+static DEFINE_MUTEX(scull_tfm_lock);
+
+static struct delayed_work scull_tier_work;
+
+/*
+ * Compress "slen" bytes into at most "*dlen"; fails if they don't fit.
+ */
+int scull_compress(const void *src, unsigned int slen, void *dst,
+		unsigned int *dlen)
+{
+	int err;
+
+	if (!scull_tfm)
+		return -ENODEV;
+	mutex_lock(&scull_tfm_lock);
+	err = crypto_comp_compress(scull_tfm, src, slen, dst, dlen);
+	mutex_unlock(&scull_tfm_lock);
+	return err;
+}
+
+/*
+ * Decompress into exactly "dlen" bytes, or fail.
+ */
+int scull_decompress(const void *src, unsigned int slen, void *dst,
+		unsigned int dlen)
+{
+	unsigned int len = dlen;
+	int err;
+
+	if (!scull_tfm)
+		return -ENODEV;
+	mutex_lock(&scull_tfm_lock);
+	err = crypto_comp_decompress(scull_tfm, src, slen, dst, &len);
+	mutex_unlock(&scull_tfm_lock);
+	if (err == 0 && len != dlen)
+		err = -EIO;
+	return err;
+}
+
+/*
+ * The worker. A device that is busy is simply left for the next pass.
+ */
+static void scull_tier_dev(struct scull_dev *dev, void *arg)
+{
+	unsigned long idle = *(unsigned long *)arg;
+
+	if (!down_write_trylock(&dev->sem))
+		return;
+	scull_tier(dev, idle);
+	up_write(&dev->sem);
+}
+
+static void scull_tier_fn(struct work_struct *work)
+{
+	int secs = READ_ONCE(scull_cold_secs);
+	unsigned long idle = (unsigned long)secs * HZ;
+	unsigned long delay = HZ;	/* just look at the parameter again */
+
+	if (secs > 0) {
+		scull_for_each_dev(scull_tier_dev, &idle);
+		delay = max(idle / 2, delay);
+	}
+	schedule_delayed_work(&scull_tier_work, delay);
+}
+
+/*
+ * Without LZ4 in the kernel, there is simply no compressed tier.
+ */
+void scull_compress_init(void)
+{
+	scull_tfm = crypto_alloc_comp("lz4", 0, 0);
+	if (IS_ERR(scull_tfm)) {
+		printk(KERN_NOTICE "scull: no lz4, no compressed tier\n");
+		scull_tfm = NULL;
+		return;
+	}
+	INIT_DELAYED_WORK(&scull_tier_work, scull_tier_fn);
+	schedule_delayed_work(&scull_tier_work, HZ);
+}
+
+/*
+ * Cold quanta can still be freed once the transform is gone, they
+ * just can't be read.
+ */
+void scull_compress_cleanup(void)
+{
+	if (!scull_tfm)
+		return;
+	cancel_delayed_work_sync(&scull_tier_work);
+	crypto_free_comp(scull_tfm);
+	scull_tfm = NULL;
+}
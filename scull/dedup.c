@@ -0,0 +1,103 @@
+/*
+ * dedup.c -- sharing identical quanta between the bare scull devices
+ *
+ * A device in dedup mode (SCULL_CTL_DEDUP) hashes every quantum it
+ * writes up to the end, and looks it up in a table shared by all the
+ * devices. If an identical quantum is already there, the device takes
+ * a reference to it and frees its own copy; otherwise its quantum
+ * goes in the table. A quantum in the table is shared like any other:
+ * it is copied before being written to, unless nobody else holds it,
+ * and then it just leaves the table first.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/string.h>	/* memcmp() */
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/xxhash.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+#define SCULL_DEDUP_BITS	10
+
+/*
+ * The table, and a spinlock to protect it. Entries don't hold a
+ * reference: a quantum leaves the table when its last user lets go of
+ * it (scull_dedup_forget), so the lookup must not resurrect one whose
+ * count already dropped to zero.
+ */
+static DEFINE_HASHTABLE(scull_dedup_table, SCULL_DEDUP_BITS);
+static DEFINE_SPINLOCK(scull_dedup_lock);
+atomic_long_t scull_dedup_entries = ATOMIC_LONG_INIT(0);
+
+/*
+ * Look for a twin of "q", which holds "size" bytes, and return it with
+ * a new reference; or enter "q" in the table and return NULL. The
+ * caller holds the semaphore of the device "q" belongs to, and q is
+ * not shared, nor cold.
+ */
+struct scull_quantum *scull_dedup_insert(struct scull_quantum *q, int size)
+{
+	struct scull_quantum *twin;
+	u64 hash = xxh64(q->data, size, 0);	/* out of the lock */
+
+	spin_lock(&scull_dedup_lock);
+	hash_for_each_possible(scull_dedup_table, twin, hnode, hash) {
+		if (twin->hash != hash || twin->hashed != size)
+			continue;
+		if (memcmp(twin->data, q->data, size))
+			continue;	/* a collision */
+		if (atomic_inc_not_zero(&twin->count)) {
+			spin_unlock(&scull_dedup_lock);
+			return twin;
+		}
+	}
+	q->hash = hash;
+	q->hashed = size;
+	hash_add(scull_dedup_table, &q->hnode, hash);
+	atomic_long_inc(&scull_dedup_entries);
+	spin_unlock(&scull_dedup_lock);
+	return NULL;
+}
+
+static void __scull_dedup_forget(struct scull_quantum *q)
+{
+	hash_del(&q->hnode);
+	q->hashed = 0;
+	atomic_long_dec(&scull_dedup_entries);
+}
+
+/*
+ * Take a quantum out of the table so that it can be changed in place,
+ * if nobody else holds it. Returns whether it did.
+ */
+int scull_dedup_claim(struct scull_quantum *q)
+{
+	int mine;
+
+	spin_lock(&scull_dedup_lock);
+	mine = atomic_read(&q->count) == 1;
+	if (mine && q->hashed)
+		__scull_dedup_forget(q);
+	spin_unlock(&scull_dedup_lock);
+	return mine;
+}
+
+/*
+ * The last reference is gone: the quantum must leave the table before
+ * its data is freed.
+ */
+void scull_dedup_forget(struct scull_quantum *q)
+{
+	spin_lock(&scull_dedup_lock);
+	if (q->hashed)
+		__scull_dedup_forget(q);
+	spin_unlock(&scull_dedup_lock);
+}
@@ -9,14 +9,24 @@
 
 #include <linux/kernel.h>	/* printk() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/gfp.h>		/* __get_free_page() */
+#include <linux/mm.h>		/* page_count() */
+#include <linux/pagemap.h>	/* fault_in_pages_writeable() */
 #include <linux/fs.h>		/* everything... */
 #include <linux/errno.h>	/* error codes */
 #include <linux/types.h>	/* size_t */
 #include <linux/proc_fs.h>
 #include <linux/fcntl.h>	/* O_ACCMODE */
+#include <linux/falloc.h>	/* FALLOC_FL_* */
 #include <linux/seq_file.h>
 #include <linux/cdev.h>
+#include <linux/radix-tree.h>
+#include <linux/rwsem.h>
 #include <linux/uaccess.h>	/* copy_*_user */
+#include <linux/uio.h>		/* copy_*_iter */
+#include <linux/file.h>		/* fdget() */
+#include <linux/jiffies.h>
+#include <linux/sched.h>	/* cond_resched() */
 #include <linux/delay.h>
 
 #include "scull.h"		/* local definitions */
@@ -30,45 +40,557 @@ int scull_minor	= 	0;
 int scull_nr_devs = 	SCULL_NR_DEVS;	/* number of bare scull devices */
 int scull_quantum = 	SCULL_QUANTUM;
 int scull_qset =	SCULL_QSET;
+int scull_span =	1;	/* read/write across quanta in one call */
+int scull_pool_max =	SCULL_POOL_MAX;	/* recycled quanta kept per device */
+unsigned long scull_mem_limit =	0;	/* bytes of quanta, all devices */
+unsigned long scull_dev_limit =	0;	/* the same, for each new device */
 
 module_param(scull_major, int, S_IRUGO);
 module_param(scull_minor, int, S_IRUGO);
 module_param(scull_nr_devs, int, S_IRUGO);
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
+module_param(scull_span, int, S_IRUGO | S_IWUSR);
+module_param(scull_pool_max, int, S_IRUGO | S_IWUSR);
+module_param(scull_mem_limit, ulong, S_IRUGO | S_IWUSR);
+module_param(scull_dev_limit, ulong, S_IRUGO | S_IWUSR);
 
 MODULE_AUTHOR("Weilin Luo");
 MODULE_LICENSE("Dual BSD/GPL");
 
 struct scull_dev *scull_devices;	/* allocated in scull_init_module */
+atomic_long_t scull_mem_used = ATOMIC_LONG_INIT(0); /* bytes in quanta */
 
 /*
- * Empty out the scull device; must be called with the device
- * semaphore held.
+ * The tree is only walked and modified with the device semaphore held,
+ * so slots need no RCU protection when dereferenced.
  */
-int scull_trim(struct scull_dev *dev)
+#define scull_deref_slot(slot)	rcu_dereference_raw(*(slot))
+
+/*
+ * Quanta and quantum sets of the load-time size come from their own
+ * slab caches; devices whose geometry was changed later fall back on
+ * kmalloc. Quanta of exactly one page come from the page allocator
+ * instead, so they are page aligned and can be mapped to user space.
+ */
+static struct kmem_cache *scull_quantum_cache;
+static struct kmem_cache *scull_qset_cache;
+static struct kmem_cache *scull_qdesc_cache;	/* struct scull_quantum */
+
+static void *scull_cache_alloc(struct kmem_cache *cache, int size)
 {
-	struct scull_qset *next, *dptr;
-	int qset = dev->qset;	/* "dev" is not null */
+	if (cache && size == kmem_cache_size(cache))
+		return kmem_cache_alloc(cache, GFP_KERNEL);
+	return kmalloc(size, GFP_KERNEL);
+}
+
+static void scull_cache_free(struct kmem_cache *cache, void *obj, int size)
+{
+	if (cache && size == kmem_cache_size(cache))
+		kmem_cache_free(cache, obj);
+	else
+		kfree(obj);
+}
+
+static void scull_free_quantum(void *data, int quantum)
+{
+	if (!data)
+		return;
+	if (quantum == PAGE_SIZE)
+		free_page((unsigned long)data);
+	else
+		scull_cache_free(scull_quantum_cache, data, quantum);
+}
+
+static void scull_free_qset(void *data, int size)
+{
+	scull_cache_free(scull_qset_cache, data, size);
+}
+
+/*
+ * The per-device pools. Trimming a device parks its quanta and
+ * quantum sets here, and the next writes take them back instead of
+ * going to the allocator. Free objects are linked through their
+ * first word, and a pool only holds objects of a single size.
+ */
+static void *scull_pool_get(struct scull_pool *pool, int size)
+{
+	void *obj = pool->head;
+
+	if (!obj || pool->size != size) {
+		pool->misses++;
+		return NULL;
+	}
+	pool->head = *(void **)obj;
+	pool->count--;
+	pool->hits++;
+	return obj;
+}
+
+static int scull_pool_put(struct scull_pool *pool, void *obj, int size)
+{
+	if (pool->count >= scull_pool_max || size < (int)sizeof(void *))
+		return 0;
+	if (pool->count && pool->size != size)
+		return 0;
+	pool->size = size;
+	*(void **)obj = pool->head;
+	pool->head = obj;
+	pool->count++;
+	return 1;
+}
+
+static unsigned long scull_pool_shrink(struct scull_pool *pool,
+		void (*release)(void *, int), unsigned long nr)
+{
+	unsigned long freed = 0;
+	void *obj;
+
+	while (freed < nr && (obj = pool->head)) {
+		pool->head = *(void **)obj;
+		pool->count--;
+		release(obj, pool->size);
+		freed++;
+	}
+	return freed;
+}
+
+static void scull_pool_drain(struct scull_pool *pool,
+		void (*release)(void *, int))
+{
+	scull_pool_shrink(pool, release, ULONG_MAX);
+}
+
+/*
+ * Drop pooled objects that do not fit the current geometry of a
+ * device any more; must be called with the device semaphore held
+ * for writing.
+ */
+static void scull_fit_pools(struct scull_dev *dev)
+{
+	if (dev->qpool.size != dev->quantum)
+		scull_pool_drain(&dev->qpool, scull_free_quantum);
+	if (dev->spool.size != dev->qset * sizeof(void *))
+		scull_pool_drain(&dev->spool, scull_free_qset);
+}
+
+/*
+ * Give back all the memory held in the pools of a device; must be
+ * called with the device semaphore held for writing.
+ */
+void scull_drain_pools(struct scull_dev *dev)
+{
+	scull_pool_drain(&dev->qpool, scull_free_quantum);
+	scull_pool_drain(&dev->spool, scull_free_qset);
+}
+
+/*
+ * The memory for one quantum of the device.
+ */
+static void *scull_alloc_qdata(struct scull_dev *dev)
+{
+	void *data = scull_pool_get(&dev->qpool, dev->quantum);
+
+	if (!data) {
+		if (dev->quantum == PAGE_SIZE)
+			data = (void *)__get_free_page(GFP_KERNEL);
+		else
+			data = scull_cache_alloc(scull_quantum_cache, dev->quantum);
+	}
+	return data;
+}
+
+/*
+ * A new quantum, with a single reference. Its contents are undefined.
+ */
+static struct scull_quantum *scull_alloc_quantum(struct scull_dev *dev)
+{
+	struct scull_quantum *q;
+
+	q = scull_cache_alloc(scull_qdesc_cache, sizeof(*q));
+	if (!q)
+		return NULL;
+	q->data = scull_alloc_qdata(dev);
+	if (!q->data) {
+		scull_cache_free(scull_qdesc_cache, q, sizeof(*q));
+		return NULL;
+	}
+	atomic_set(&q->count, 1);
+	q->atime = jiffies;
+	q->clen = 0;
+	q->hashed = 0;
+	dev->nquanta++;
+	atomic_long_add(dev->quantum, &scull_mem_used);
+	scull_stat_inc(dev, quanta);
+	return q;
+}
+
+/*
+ * Take one more reference to a quantum, for a set of "dev"; must be
+ * called with the semaphore of "dev" held for writing.
+ */
+static void scull_ref_quantum(struct scull_dev *dev, struct scull_quantum *q)
+{
+	atomic_inc(&q->count);
+	dev->nquanta++;
+	if (q->clen) {
+		dev->ncold++;
+		dev->cbytes += q->clen;
+	}
+}
+
+/*
+ * Would "refs" more quanta in the device, "new" of them freshly
+ * allocated, take it or the whole driver over its cap? The device cap
+ * counts every quantum the device refers to, the global one only
+ * counts memory really in use, so shared quanta are charged once. The
+ * global count is shared by devices that don't exclude each other, so
+ * concurrent writers may overshoot it by a quantum each.
+ */
+static int scull_mem_full(struct scull_dev *dev, long refs, int new)
+{
+	unsigned long limit = READ_ONCE(scull_mem_limit);
+
+	if (dev->limit && (dev->nquanta + refs) * dev->quantum > dev->limit)
+		return 1;
+	if (new && limit &&
+			atomic_long_read(&scull_mem_used) + dev->quantum > limit)
+		return 1;
+	return 0;
+}
+
+static struct scull_quantum **scull_alloc_qset(struct scull_dev *dev)
+{
+	int size = dev->qset * sizeof(void *);
+	struct scull_quantum **qs = scull_pool_get(&dev->spool, size);
+
+	if (!qs)
+		qs = scull_cache_alloc(scull_qset_cache, size);
+	if (qs)
+		memset(qs, 0, size);
+	return qs;
+}
+
+/*
+ * Drop a reference to a quantum of the given size; the last one
+ * releases it, recycling it in the device pools if "recycle" is set
+ * and there is room. A page quantum that was spliced into a pipe is
+ * still in use there: it is not recycled, and free_page only drops
+ * our reference to it. Returns whether the quantum was released.
+ */
+static int __scull_put_quantum(struct scull_dev *dev, struct scull_quantum *q,
+		int quantum, int recycle)
+{
+	void *data;
+
+	if (!q)
+		return 0;
+	dev->nquanta--;
+	if (q->clen) {
+		dev->ncold--;
+		dev->cbytes -= q->clen;
+	}
+	if (!atomic_dec_and_test(&q->count))
+		return 0;	/* some other set still has it */
+	if (q->hashed)
+		scull_dedup_forget(q);
+	data = q->data;
+	if (q->clen) {	/* a cold quantum is only its compressed copy */
+		atomic_long_sub(q->clen, &scull_mem_used);
+		scull_cache_free(scull_qdesc_cache, q, sizeof(*q));
+		kfree(data);
+		return 1;
+	}
+	scull_cache_free(scull_qdesc_cache, q, sizeof(*q));
+	atomic_long_sub(quantum, &scull_mem_used);
+	if (quantum == PAGE_SIZE && page_count(virt_to_page(data)) != 1)
+		recycle = 0;
+	if (!recycle || !scull_pool_put(&dev->qpool, data, quantum))
+		scull_free_quantum(data, quantum);
+	return 1;
+}
+
+static void scull_put_quantum(struct scull_dev *dev, struct scull_quantum *q,
+		int quantum)
+{
+	__scull_put_quantum(dev, q, quantum, 1);
+}
+
+/*
+ * Is a quantum ours alone, so that it can be changed in place? Nobody
+ * can take a new reference to it while we hold the device semaphore,
+ * unless it is in the dedup table, where anyone can find it: in that
+ * case it leaves the table, if no one did.
+ */
+static int scull_exclusive(struct scull_quantum *q)
+{
+	if (q->hashed)
+		return scull_dedup_claim(q);
+	return atomic_read(&q->count) == 1;
+}
+
+/*
+ * The compressed tier (see compress.c). A cold quantum holds in "data"
+ * a kmalloc'ed copy of itself compressed to "clen" bytes. Only quanta
+ * that are not shared are frozen or thawed in place, with the device
+ * semaphore held for writing; a shared one is never changed, whoever
+ * needs it hot makes a copy.
+ */
+static int scull_thaw(struct scull_dev *dev, struct scull_quantum *q)
+{
+	void *data = scull_alloc_qdata(dev);
+
+	if (!data)
+		return -ENOMEM;
+	if (scull_decompress(q->data, q->clen, data, dev->quantum)) {
+		scull_free_quantum(data, dev->quantum);
+		return -EIO;
+	}
+	kfree(q->data);
+	q->data = data;
+	atomic_long_add(dev->quantum - q->clen, &scull_mem_used);
+	dev->ncold--;
+	dev->cbytes -= q->clen;
+	q->clen = 0;
+	return 0;
+}
+
+/*
+ * Compress a quantum, with "buf" as a quantum-sized scratch area. It
+ * is only worth it if it saves a quarter of the memory at least.
+ */
+static int scull_freeze(struct scull_dev *dev, struct scull_quantum *q, void *buf)
+{
+	unsigned int clen = dev->quantum - dev->quantum / 4;
+	void *cdata;
+
+	if (scull_compress(q->data, dev->quantum, buf, &clen))
+		return -E2BIG;	/* or at least, not small enough */
+	cdata = kmalloc(clen, GFP_KERNEL);
+	if (!cdata)
+		return -ENOMEM;
+	memcpy(cdata, buf, clen);
+	scull_free_quantum(q->data, dev->quantum);
+	q->data = cdata;
+	q->clen = clen;
+	atomic_long_sub(dev->quantum - clen, &scull_mem_used);
+	dev->ncold++;
+	dev->cbytes += clen;
+	return 0;
+}
+
+/*
+ * The contents of a quantum of the given size, hot or cold, for
+ * reading: a cold one is decompressed into "*buf", allocated the first
+ * time it is needed. The caller frees it. NULL if the quantum can't
+ * be read.
+ */
+static void *scull_qbytes(struct scull_quantum *q, int quantum, void **buf)
+{
+	if (!q->clen)
+		return q->data;
+	if (!*buf)
+		*buf = kmalloc(quantum, GFP_KERNEL);
+	if (!*buf || scull_decompress(q->data, q->clen, *buf, quantum))
+		return NULL;
+	return *buf;
+}
+
+/*
+ * One pass of the background worker over a device, with its semaphore
+ * held for writing: quanta left alone for "idle" jiffies are frozen,
+ * cold ones that were read since then are thawed again. Page quanta
+ * are left alone, as they may be mapped or spliced.
+ */
+void scull_tier(struct scull_dev *dev, unsigned long idle)
+{
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	struct scull_quantum **dptr, *q;
+	void *buf;
 	int i;
 
-	for (dptr = dev->data; dptr; dptr = next) { /* all the list items */
-		if (dptr->data) {
-			for (i = 0; i < qset; i++)
-				kfree(dptr->data[i]);
-			kfree(dptr->data);
-			dptr->data = NULL;
+	if (dev->quantum == PAGE_SIZE || !dev->data)
+		return;
+	buf = kmalloc(dev->quantum, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	radix_tree_for_each_slot(slot, dev->data, &iter, 0) {
+		dptr = scull_deref_slot(slot);
+		for (i = 0; i < dev->qset; i++) {
+			q = dptr[i];
+			if (!q)
+				continue;
+			/* claim it last: that takes it out of the dedup table */
+			if (!q->clen && time_after(jiffies, q->atime + idle)) {
+				if (scull_exclusive(q) &&
+						scull_freeze(dev, q, buf) == -E2BIG)
+					q->atime = jiffies;	/* try later */
+			} else if (q->clen && time_before(jiffies, q->atime + idle) &&
+					scull_exclusive(q))
+				scull_thaw(dev, q);
 		}
-		next = dptr->next;
-		kfree(dptr);
+		cond_resched();
 	}
-	dev->size = 0;
-	dev->quantum = scull_quantum;
-	dev->qset = scull_qset;
+	kfree(buf);
+}
+
+/*
+ * A quantum was just written up to its end, on a device in dedup
+ * mode: share an identical one from the dedup table instead, or enter
+ * it in the table for others to share.
+ */
+static struct scull_quantum *scull_dedup_quantum(struct scull_dev *dev,
+		struct scull_quantum *q)
+{
+	struct scull_quantum *twin = scull_dedup_insert(q, dev->quantum);
+
+	if (!twin) {
+		scull_stat_inc(dev, dedup_misses);
+		return q;
+	}
+	dev->nquanta++;		/* the table got us a reference already */
+	scull_put_quantum(dev, q, dev->quantum);
+	scull_stat_inc(dev, dedup_hits);
+	return twin;
+}
+
+/*
+ * Get quantum "*qp" ready to be written, allocating it if it is a hole
+ * and copying it if it is shared; must be called with the device
+ * semaphore held for writing. New quanta are zeroed, as the parts of
+ * them not written to are read back as data.
+ */
+static struct scull_quantum *scull_writable(struct scull_dev *dev,
+		struct scull_quantum **qp)
+{
+	struct scull_quantum *q = *qp, *new;
+	int err;
+
+	if (q && scull_exclusive(q)) {
+		if (q->clen) {
+			err = scull_thaw(dev, q);
+			if (err)
+				return ERR_PTR(err);
+		}
+		q->atime = jiffies;
+		return q;
+	}
+	if (scull_mem_full(dev, !q, 1))
+		return ERR_PTR(-ENOSPC);
+	new = scull_alloc_quantum(dev);
+	if (!new)
+		return ERR_PTR(-ENOMEM);
+	if (q && q->clen) {	/* shared and cold: not ours to thaw */
+		if (scull_decompress(q->data, q->clen, new->data, dev->quantum)) {
+			scull_put_quantum(dev, new, dev->quantum);
+			return ERR_PTR(-EIO);
+		}
+	} else if (q)
+		memcpy(new->data, q->data, dev->quantum);
+	else
+		memset(new->data, 0, dev->quantum);
+	if (q) {
+		scull_put_quantum(dev, q, dev->quantum);
+		scull_stat_inc(dev, cow);
+	}
+	*qp = new;
+	return new;
+}
+
+static void scull_put_qset(struct scull_dev *dev, struct scull_quantum **dptr,
+		int qset)
+{
+	if (!scull_pool_put(&dev->spool, dptr, qset * sizeof(void *)))
+		scull_free_qset(dptr, qset * sizeof(void *));
+}
+
+/*
+ * Release a whole tree of quantum sets laid out with the given
+ * geometry, recycling what fits in the device pools.
+ */
+static void scull_free_data(struct scull_dev *dev, struct radix_tree_root *root,
+		int quantum, int qset)
+{
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	struct scull_quantum **dptr;
+	int i;
+
+	radix_tree_for_each_slot(slot, root, &iter, 0) { /* all the sets */
+		dptr = scull_deref_slot(slot);
+		for (i = 0; i < qset; i++)
+			scull_put_quantum(dev, dptr[i], quantum);
+		scull_put_qset(dev, dptr, qset);
+		radix_tree_iter_delete(root, &iter, slot);
+	}
+	kfree(root);
+}
+
+/*
+ * Empty out the scull device; must be called with the device
+ * semaphore held for writing. The geometry of the device is kept.
+ */
+int scull_trim(struct scull_dev *dev)
+{
+	if (atomic_read(&dev->vmas)) /* don't trim: there are active mappings */
+		return -EBUSY;
+
+	if (dev->data)	/* "dev" is not null */
+		scull_free_data(dev, dev->data, dev->quantum, dev->qset);
 	dev->data = NULL;
+	dev->size = 0;
+	scull_stat_inc(dev, trims);
 	return 0;
 }
 
+/*
+ * Give back up to nr objects when memory is short; called by the
+ * shrinker with the device semaphore held for writing. The pools go
+ * first. Then, if the device is only a cache, so does its data: the
+ * dropped quanta become holes, which SEEK_HOLE lets users find.
+ * Shared quanta stay: dropping them would free nothing, and only
+ * what was really freed is counted.
+ */
+unsigned long scull_shrink(struct scull_dev *dev, unsigned long nr)
+{
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	struct scull_quantum **dptr;
+	unsigned long freed;
+	int i, used;
+
+	freed = scull_pool_shrink(&dev->qpool, scull_free_quantum, nr);
+	freed += scull_pool_shrink(&dev->spool, scull_free_qset, nr - freed);
+	if (!dev->cache || !dev->data || atomic_read(&dev->vmas))
+		return freed;
+
+	radix_tree_for_each_slot(slot, dev->data, &iter, 0) {
+		if (freed >= nr)
+			break;
+		dptr = scull_deref_slot(slot);
+		for (i = used = 0; i < dev->qset; i++) {
+			if (!dptr[i])
+				continue;
+			/* a shared quantum would only lose its data here */
+			if (freed >= nr || atomic_read(&dptr[i]->count) > 1) {
+				used++;
+				continue;
+			}
+			if (__scull_put_quantum(dev, dptr[i], dev->quantum, 0))
+				freed++;	/* unless it got shared meanwhile */
+			dptr[i] = NULL;
+		}
+		if (!used) {
+			scull_free_qset(dptr, dev->qset * sizeof(void *));
+			radix_tree_iter_delete(dev->data, &iter, slot);
+			freed++;
+		}
+	}
+	return freed;
+}
+
 #ifdef SCULL_DEBUG	/* use proc only if debugging */
 
 #if 0 /* obsolete */
@@ -138,24 +660,33 @@ static void scull_seq_stop(struct seq_file *s, void *v)
 static int scull_seq_show(struct seq_file *s, void *v)
 {
 	struct scull_dev *dev = (struct scull_dev *) v;
-	struct scull_qset *d;
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	struct scull_quantum **d, **last = NULL;
 	int i;
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+	scull_down_read(dev);
 	seq_printf(s, "\nDevice %i: qset %i, q %i, sz %li\n",
 			(int) (dev - scull_devices), dev->qset,
 			dev->quantum, dev->size);
-	for (d = dev->data; d; d = d->next) {	/* scan the list */
-		seq_printf(s, " item at %p, qset at %p\n", d, d->data);
-		if (d->data && !d->next)	/* dump only the last item */
-			for (i = 0; i < dev->qset; i++) {
-				if (d->data[i])
-					seq_printf(s, "    % 4i: %8p\n",
-							i, d->data[i]);
-			}
-	}
-	up(&dev->sem);
+	if (dev->data)
+		radix_tree_for_each_slot(slot, dev->data, &iter, 0) { /* scan the tree */
+			d = scull_deref_slot(slot);
+			seq_printf(s, " item %lu, qset at %p\n", iter.index, d);
+			last = d;
+		}
+	if (last)	/* dump only the last item */
+		for (i = 0; i < dev->qset; i++) {
+			if (last[i])
+				seq_printf(s, "    % 4i: %8p (%i)\n", i,
+						last[i]->data,
+						atomic_read(&last[i]->count));
+		}
+	seq_printf(s, " pool: %i quanta, %lu hits, %lu misses\n",
+			dev->qpool.count, dev->qpool.hits, dev->qpool.misses);
+	seq_printf(s, " qset pool: %i sets, %lu hits, %lu misses\n",
+			dev->spool.count, dev->spool.hits, dev->spool.misses);
+	up_read(&dev->sem);
 	return 0;
 }
 
@@ -233,10 +764,10 @@ int scull_open(struct inode *inode, struct file *filp)
 
 	/* now trim to 0 the length of the device if open was write-only */
 	if ( (filp->f_flags & O_ACCMODE) == O_WRONLY) {
-		if (down_interruptible(&dev->sem))
+		if (scull_down_write(dev))
 			return -ERESTARTSYS;
 		scull_trim(dev);	/* ignore errors */
-		up(&dev->sem);
+		up_write(&dev->sem);
 	}
 	return 0;	/* success */	
 }
@@ -247,78 +778,157 @@ int scull_release(struct inode *inode, struct file *filp)
 }
 
 /*
- * Follow the list
+ * Find quantum set "n". The tree is indexed by set number, so the
+ * cost does not depend on how far into the device we are.
+ */
+struct scull_quantum **scull_follow(struct scull_dev *dev, unsigned long n)
+{
+	if (!dev->data)
+		return NULL;	/* empty device */
+	return radix_tree_lookup(dev->data, n);
+}
+
+/*
+ * Same as scull_follow, but allocate the quantum set if it is
+ * missing; must be called with the device semaphore held for writing.
  */
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+static struct scull_quantum **scull_follow_alloc(struct scull_dev *dev,
+		unsigned long n)
 {
-	struct scull_qset *qs = dev->data;
+	struct scull_quantum **qs;
 
-	/* Allocate first qset explicitly if need be */
-	if (!qs) {
-		qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-		if (qs == NULL)
+	/* Allocate the tree explicitly if need be */
+	if (!dev->data) {
+		dev->data = kmalloc(sizeof(struct radix_tree_root), GFP_KERNEL);
+		if (!dev->data)
 			return NULL;	/* Never mind */
-		memset(qs, 0, sizeof(struct scull_qset));
+		INIT_RADIX_TREE(dev->data, GFP_KERNEL);
 	}
 
-	/* Then follow the list */
-	while (n--) {
-		if (!qs->next) {
-			qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-			if (qs->next == NULL)
-				return NULL;	/* Never mind */
-			memset(qs->next, 0, sizeof(struct scull_qset));
-		}
-		qs = qs->next;
-		continue;
+	qs = radix_tree_lookup(dev->data, n);
+	if (qs)
+		return qs;
+	qs = scull_alloc_qset(dev);
+	if (qs == NULL)
+		return NULL;	/* Never mind */
+	if (radix_tree_insert(dev->data, n, qs)) {
+		scull_free_qset(qs, dev->qset * sizeof(void *));
+		return NULL;
 	}
 	return qs;
 }
 
 /*
- * Data management: read and write
+ * Data management: read and write. Both work on an iov_iter, so
+ * plain read/write as well as readv/writev and aio requests are
+ * served in one pass under the device semaphore.
+ */
+
+/*
+ * Fault in the next "bytes" of a read destination, with no semaphore
+ * held. Only user memory can fault: anything else failed for good.
  */
+static int scull_fault_in_writeable(struct iov_iter *i, size_t bytes)
+{
+	struct iovec iov;
+
+	if (!iter_is_iovec(i))
+		return -EFAULT;
+	iov = iov_iter_iovec(i);
+	return fault_in_pages_writeable(iov.iov_base,
+			min_t(size_t, bytes, iov.iov_len));
+}
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
-		loff_t *f_pos)
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;	/* the first listitem */
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;	/* how many bytes in the listitem */
-	int item, s_pos, q_pos, rest;
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	loff_t *f_pos = &iocb->ki_pos;
+	size_t count = iov_iter_count(to);
+	struct scull_quantum **dptr;	/* the quantum set */
+	void *data, *buf = NULL;	/* buf: for cold quanta */
+	int quantum, qset;
+	int itemsize;			/* how many bytes in the listitem */
+	unsigned long item;
+	int s_pos, q_pos, rest;
+	size_t chunk, copied;
 	ssize_t retval = 0;
 
-	PDEBUG("scull_read() is called.\n");
+	PDEBUG("scull_read_iter() is called.\n");
 
-	if (down_interruptible(&dev->sem))	
-		return -ERESTARTSYS;
+	/*
+	 * Readers never change the device, so any number of them can
+	 * run together; they only exclude writers and trims.
+	 */
+	scull_down_read(dev);
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
 	if (*f_pos >= dev->size)
 		goto out;
 	if (*f_pos + count > dev->size)
 		count = dev->size - *f_pos;
 
-	/* find listitem, qset index, and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
-
-	/* follow the list up to the right position (defined elsewhere) */
-	dptr = scull_follow(dev, item);
-
-	if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-		goto out;	/* don't fill holes */
-
-	/* read only up to the end of this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	while (count > 0) {
+		/* find listitem, qset index, and offset in the quantum */
+		item = (long)*f_pos / itemsize;
+		rest = (long)*f_pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		/* look up the quantum set (defined elsewhere) */
+		dptr = scull_follow(dev, item);
+
+		/*
+		 * Read only up to the end of this quantum; copy_to_iter
+		 * spreads it over as many user segments as needed.
+		 */
+		chunk = min(count, (size_t)(quantum - q_pos));
+
+		if (dptr == NULL || !dptr[s_pos]) {
+			pagefault_disable();	/* see below */
+			copied = iov_iter_zero(chunk, to);	/* holes read as zeroes */
+			pagefault_enable();
+		} else {
+			data = scull_qbytes(dptr[s_pos], quantum, &buf);
+			if (!data) {
+				if (!retval)
+					retval = -EIO;
+				break;
+			}
+			WRITE_ONCE(dptr[s_pos]->atime, jiffies);
+			pagefault_disable();
+			copied = copy_to_iter(data + q_pos, chunk, to);
+			pagefault_enable();
+		}
+		*f_pos += copied;
+		count -= copied;
+		retval += copied;
+		if (copied < chunk) {
+			/*
+			 * As in scull_write_iter: the destination may be a
+			 * private mapping of this device, whose fault handler
+			 * takes the semaphore again, and a writer queued in
+			 * between would block it. Fault it in unlocked, then
+			 * look at the device again.
+			 */
+			up_read(&dev->sem);
+			if (scull_fault_in_writeable(to, chunk - copied)) {
+				if (!retval)
+					retval = -EFAULT;
+				goto out_unlocked;
+			}
+			scull_down_read(dev);
+			quantum = dev->quantum;
+			qset = dev->qset;
+			itemsize = quantum * qset;
+			if (*f_pos >= dev->size)
+				break;
+			count = min(count, (size_t)(dev->size - *f_pos));
+			continue;
+		}
 
-	if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count)) {
-		retval = -EFAULT;
-		goto out;
+		if (!scull_span)
+			break;	/* one quantum per call */
 	}
-	*f_pos += count;
-	retval = count;
 
 	/* try out jiffies and counter registers */
 #if 0
@@ -336,72 +946,339 @@ ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
 #endif
 
   out:
-	up(&dev->sem);
+	up_read(&dev->sem);
+  out_unlocked:
+	kfree(buf);
+	scull_stat_inc(dev, reads);
+	if (retval > 0)
+		scull_stat_add(dev, read_bytes, retval);
 	return retval;
 }
 
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_pos)
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct scull_dev *dev = filp->private_data;
-	struct scull_qset *dptr;
-	int quantum = dev->quantum, qset = dev->qset;
-	int itemsize = quantum * qset;
-	int item, s_pos, q_pos, rest;
-	ssize_t retval = -ENOMEM;	/* value used in "goto out" statements */
-
-	PDEBUG("scull_write() is called.\n");
-
-	if (down_interruptible(&dev->sem))
+	struct scull_dev *dev = iocb->ki_filp->private_data;
+	loff_t *f_pos = &iocb->ki_pos;
+	size_t count = iov_iter_count(from);
+	struct scull_quantum **dptr, *q, *old;
+	int quantum, qset;
+	int itemsize;
+	unsigned long item;
+	int s_pos, q_pos, rest;
+	size_t chunk, copied;
+	ssize_t retval = 0;	/* bytes written so far */
+	int err;
+
+	PDEBUG("scull_write_iter() is called.\n");
+
+	if (scull_down_write(dev))
 		return -ERESTARTSYS;
+	quantum = dev->quantum;
+	qset = dev->qset;
+	itemsize = quantum * qset;
+
+	while (count > 0) {
+		/* find listitem, qset index and offset in the quantum */
+		item = (long)*f_pos / itemsize;
+		rest = (long)*f_pos % itemsize;
+		s_pos = rest / quantum; q_pos = rest % quantum;
+
+		/* look up the quantum set, creating it if need be */
+		err = -ENOMEM;
+		dptr = scull_follow_alloc(dev, item);
+		if (dptr == NULL)
+			goto fail;
+		old = dptr[s_pos];
+		q = scull_writable(dev, &dptr[s_pos]);
+		if (IS_ERR(q)) {
+			err = PTR_ERR(q);
+			goto fail;
+		}
 
-	/* find listitem, qset index and offset in the quantum */
-	item = (long)*f_pos / itemsize;
-	rest = (long)*f_pos % itemsize;
-	s_pos = rest / quantum; q_pos = rest % quantum;
+		/* write only up to the end of the this quantum */
+		chunk = min(count, (size_t)(quantum - q_pos));
+
+		/* no faults with the semaphore held: see below */
+		pagefault_disable();
+		copied = copy_from_iter(q->data + q_pos, chunk, from);
+		pagefault_enable();
+		if (dev->dedup && q_pos + copied == quantum)
+			dptr[s_pos] = scull_dedup_quantum(dev, q);
+
+		/*
+		 * If the quantum was replaced by a copy or a twin, mappings
+		 * of the device still point to the old page: have them
+		 * fault again.
+		 */
+		if (old && dptr[s_pos] != old && atomic_read(&dev->vmas))
+			unmap_mapping_range(iocb->ki_filp->f_mapping,
+					(loff_t)(item * qset + s_pos) * quantum,
+					quantum, 1);
+		*f_pos += copied;
+		count -= copied;
+		retval += copied;
+		if (copied < chunk) {
+			/*
+			 * The source is not in memory. It can't be faulted
+			 * in with the semaphore held, as it may be a mapping
+			 * of this very device, whose fault handler takes the
+			 * semaphore too: let go of it, fault the source in,
+			 * and go on from where we are. The device may have
+			 * changed meanwhile, so look at it again.
+			 */
+			if (dev->size < *f_pos)
+				dev->size = *f_pos;
+			up_write(&dev->sem);
+			if (iov_iter_fault_in_readable(from, chunk - copied)) {
+				if (!retval)
+					retval = -EFAULT;
+				goto out_unlocked;
+			}
+			if (scull_down_write(dev)) {
+				if (!retval)
+					retval = -ERESTARTSYS;
+				goto out_unlocked;
+			}
+			quantum = dev->quantum;
+			qset = dev->qset;
+			itemsize = quantum * qset;
+			continue;
+		}
 
-	/* follow the list up to the right position */
-	dptr = scull_follow(dev, item);	
-	if (dptr == NULL)
-		goto out;
-	if (!dptr->data) {
-		dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-		if (!dptr->data)
-			goto out;
-		memset(dptr->data, 0, qset * sizeof(char *));
+		if (!scull_span)
+			break;	/* one quantum per call */
 	}
-	if (!dptr->data[s_pos]) {
-		dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-		if (!dptr->data[s_pos])
-			goto out;
-	}
-	/* write only up to the end of the this quantum */
-	if (count > quantum - q_pos)
-		count = quantum - q_pos;
+	goto out;
 
-	if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count)) {
-		retval = -EFAULT;
-		goto out;
-	}
-	*f_pos += count;
-	retval = count;
-	
+  fail:
+	if (!retval)
+		retval = err;
+  out:
 	/* update the size */
 	if (dev->size < *f_pos)
 		dev->size = *f_pos;
+	up_write(&dev->sem);
+  out_unlocked:
+	scull_stat_inc(dev, writes);
+	if (retval > 0)
+		scull_stat_add(dev, write_bytes, retval);
+	return retval;
+}
 
-  out:
-	up(&dev->sem);
+/*
+ * Change the geometry of a device, moving its data over to quanta and
+ * quantum sets of the new size; must be called with the device
+ * semaphore held for writing. The new layout is built completely
+ * before the old one is released, so on failure the device is left
+ * untouched. New quanta are held against the caps like those of a
+ * write; the old layout, soon gone, only counts for the global one.
+ */
+static int scull_relayout(struct scull_dev *dev, int quantum, int qset)
+{
+	struct radix_tree_root *old = dev->data;
+	int oquantum = dev->quantum, oqset = dev->qset;
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+	struct scull_quantum **optr, **dptr;
+	void *data, *buf = NULL;	/* buf: for cold quanta */
+	unsigned long base, pos, end, item;
+	unsigned long onquanta = dev->nquanta;
+	int i, s_pos, q_pos, rest, chunk, err = -ENOMEM;
+
+	if (quantum <= 0 || qset <= 0 || quantum > INT_MAX / qset)
+		return -EINVAL;
+	if (quantum == oquantum && qset == oqset)
+		return 0;
+	if (atomic_read(&dev->vmas))	/* mapped pages would go stale */
+		return -EBUSY;
+
+	/* build the new layout next to the old one */
+	dev->data = NULL;
+	dev->quantum = quantum;
+	dev->qset = qset;
+
+	if (old)
+		radix_tree_for_each_slot(slot, old, &iter, 0) {
+			optr = scull_deref_slot(slot);
+			for (i = 0; i < oqset; i++) {
+				if (!optr[i])
+					continue;	/* holes stay holes */
+				base = (iter.index * oqset + i) * oquantum;
+				if (quantum == oquantum) {
+					/* only qset changes: share the quanta */
+					dptr = scull_follow_alloc(dev, base / (quantum * qset));
+					if (dptr == NULL)
+						goto fail;
+					s_pos = (base / quantum) % qset;
+					scull_ref_quantum(dev, optr[i]);
+					dptr[s_pos] = optr[i];
+					continue;
+				}
+				data = scull_qbytes(optr[i], oquantum, &buf);
+				if (!data)
+					goto fail;
+				pos = base;
+				end = min(base + oquantum, dev->size);
+				while (pos < end) {
+					item = pos / (quantum * qset);
+					rest = pos % (quantum * qset);
+					s_pos = rest / quantum; q_pos = rest % quantum;
+
+					dptr = scull_follow_alloc(dev, item);
+					if (dptr == NULL)
+						goto fail;
+					if (!dptr[s_pos]) {
+						if (scull_mem_full(dev, 1 - (long)onquanta, 1)) {
+							err = -ENOSPC;
+							goto fail;
+						}
+						dptr[s_pos] = scull_alloc_quantum(dev);
+						if (!dptr[s_pos])
+							goto fail;
+						/* the old layout may have a hole here */
+						memset(dptr[s_pos]->data, 0, quantum);
+					}
+					chunk = min(end - pos, (unsigned long)(quantum - q_pos));
+					memcpy(dptr[s_pos]->data + q_pos,
+						data + (pos - base), chunk);
+					pos += chunk;
+				}
+			}
+		}
+
+	if (old)
+		scull_free_data(dev, old, oquantum, oqset);
+	scull_fit_pools(dev);
+	kfree(buf);
+	return 0;
+
+  fail:
+	kfree(buf);
+	if (dev->data)
+		scull_free_data(dev, dev->data, quantum, qset);
+	dev->data = old;
+	dev->quantum = oquantum;
+	dev->qset = oqset;
+	scull_fit_pools(dev);
+	return err;
+}
+
+/*
+ * Set the geometry of a device, under its semaphore. A zero value
+ * keeps the current quantum or qset; negative ones are invalid. The
+ * values it replaces are returned in "oquantum" and "oqset", if not
+ * NULL, from under the same hold of the semaphore: an exchange is
+ * atomic.
+ */
+static int scull_set_geometry(struct scull_dev *dev, long quantum, long qset,
+		int *oquantum, int *oqset)
+{
+	int retval;
+
+	if (quantum < 0 || qset < 0 || quantum > INT_MAX || qset > INT_MAX)
+		return -EINVAL;
+	if (scull_down_write(dev))
+		return -ERESTARTSYS;
+	if (oquantum)
+		*oquantum = dev->quantum;
+	if (oqset)
+		*oqset = dev->qset;
+	retval = scull_relayout(dev, quantum ? quantum : dev->quantum,
+			qset ? qset : dev->qset);
+	up_write(&dev->sem);
 	return retval;
 }
 
+/* The single-value ioctls: there zero is as invalid as a negative value */
+static int scull_set_quantum(struct scull_dev *dev, long quantum, int *old)
+{
+	return scull_set_geometry(dev, quantum ? quantum : -1, 0, old, NULL);
+}
+
+static int scull_set_qset(struct scull_dev *dev, long qset, int *old)
+{
+	return scull_set_geometry(dev, 0, qset ? qset : -1, NULL, old);
+}
+
+/*
+ * The batched control: apply all the settings of a struct scull_ctl
+ * under a single hold of the semaphore, and report the current state
+ * of the device in the same structure.
+ */
+static long scull_ctl(struct file *filp, struct scull_ctl __user *uctl)
+{
+	struct scull_dev *dev = filp->private_data;
+	struct scull_ctl ctl;
+	int change;
+	long retval = 0;
+
+	if (copy_from_user(&ctl, uctl, sizeof(ctl)))
+		return -EFAULT;
+	if (ctl.quantum < 0 || ctl.qset < 0 || ctl.pipe_buffer ||
+			(ctl.flags & ~SCULL_CTL_FLAGS))
+		return -EINVAL;	/* a bare device has no pipe buffer */
+	if ((ctl.quantum || ctl.qset) && !capable(CAP_SYS_ADMIN))
+		return -EPERM;
+	if ((ctl.flags & SCULL_CTL_CACHE) && (ctl.flags & SCULL_CTL_NOCACHE))
+		return -EINVAL;
+	if ((ctl.flags & SCULL_CTL_DEDUP) && (ctl.flags & SCULL_CTL_NODEDUP))
+		return -EINVAL;
+	if (ctl.flags && !(filp->f_mode & FMODE_WRITE))
+		return -EBADF;	/* all flags may throw data away */
+
+	/* a plain query does not need to exclude the readers */
+	change = ctl.quantum || ctl.qset || ctl.flags;
+	if (change) {
+		if (scull_down_write(dev))
+			return -ERESTARTSYS;
+	} else
+		scull_down_read(dev);
+
+	if (ctl.flags & SCULL_CTL_TRIM)
+		retval = scull_trim(dev);
+	if (ctl.flags & SCULL_CTL_CACHE)
+		dev->cache = 1;
+	if (ctl.flags & SCULL_CTL_NOCACHE)
+		dev->cache = 0;
+	if (ctl.flags & SCULL_CTL_DEDUP)
+		dev->dedup = 1;
+	if (ctl.flags & SCULL_CTL_NODEDUP)
+		dev->dedup = 0;
+	if (retval == 0 && (ctl.quantum || ctl.qset))
+		retval = scull_relayout(dev, ctl.quantum ? ctl.quantum : dev->quantum,
+				ctl.qset ? ctl.qset : dev->qset);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.quantum = dev->quantum;
+	ctl.qset = dev->qset;
+	ctl.size = dev->size;
+	ctl.quanta = dev->nquanta;
+	ctl.pool_hits = dev->qpool.hits;
+	ctl.pool_misses = dev->qpool.misses;
+
+	if (change)
+		up_write(&dev->sem);
+	else
+		up_read(&dev->sem);
+
+	if (retval == 0 && copy_to_user(uctl, &ctl, sizeof(ctl)))
+		retval = -EFAULT;
+	return retval;
+}
+
+static long scull_clone_ioctl(struct file *filp,
+		struct scull_clone __user *uarg);	/* below, with cloning */
+
 /*
  * The ioctl() implementation
  */
 
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-	int err = 0, tmp;
+	struct scull_dev *dev = filp->private_data;
+	struct scull_range range;
+	__u64 limit;
+	int err = 0, tmp, old;
 	long retval = 0;
 
 	/*
@@ -425,93 +1302,126 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 
 	switch(cmd) {
 
-	  case SCULL_IOCRESET:
-		scull_quantum = SCULL_QUANTUM;
-		scull_qset = SCULL_QSET;
+	  case SCULL_IOCRESET:	/* back to the load-time geometry */
+		if (! capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		retval = scull_set_geometry(dev, scull_quantum, scull_qset,
+				NULL, NULL);
 		break;
 
 	  case SCULL_IOCSQUANTUM:	/* Set: arg points to the value */
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		retval = __get_user(scull_quantum, (int __user *)arg);
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval == 0)
+			retval = scull_set_quantum(dev, tmp, NULL);
 		break;
 
 	  case SCULL_IOCTQUANTUM:	/* Tell: arg is the value */
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		scull_quantum = arg;
-		break;	
+		retval = scull_set_quantum(dev, arg, NULL);
+		break;
 
 	  case SCULL_IOCGQUANTUM:	/* Get: arg is pointer to result */
-		retval = __put_user(scull_quantum, (int __user *)arg);
+		retval = __put_user(dev->quantum, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCQQUANTUM:	/* Query: return it (it's positive) */
-		return scull_quantum;
+		return dev->quantum;
 
 	  case SCULL_IOCXQUANTUM:	/* eXchange: use arg as pointer */
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		tmp = scull_quantum;
-		retval = __get_user(scull_quantum, (int __user *)arg);
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval == 0)
+			retval = scull_set_quantum(dev, tmp, &old);
 		if (retval == 0)
-			retval = __put_user(tmp, (int __user *)arg);
+			retval = __put_user(old, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCHQUANTUM:	/* sHift: like Tell + Query */
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		tmp = scull_quantum;
-		scull_quantum = arg;
-		return tmp;	
+		retval = scull_set_quantum(dev, arg, &old);
+		return retval ? retval : old;
 
 	  case SCULL_IOCSQSET:
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		retval = __get_user(scull_qset, (int __user *)arg);
+		retval = __get_user(tmp, (int __user *)arg);
+		if (retval == 0)
+			retval = scull_set_qset(dev, tmp, NULL);
 		break;
 
 	  case SCULL_IOCTQSET:
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		scull_qset = arg;
+		retval = scull_set_qset(dev, arg, NULL);
 		break;
 	  
 	  case SCULL_IOCGQSET:
-		retval = __put_user(scull_qset, (int __user *)arg);
+		retval = __put_user(dev->qset, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCQQSET:
-		return scull_qset;
+		return dev->qset;
 
 	  case SCULL_IOCXQSET:
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		tmp = scull_qset;
-		retval = __get_user(scull_qset, (int __user *)arg);
+		retval = __get_user(tmp, (int __user *)arg);
 		if (retval == 0)
-			retval = __put_user(tmp, (int __user *)arg);
+			retval = scull_set_qset(dev, tmp, &old);
+		if (retval == 0)
+			retval = __put_user(old, (int __user *)arg);
 		break;
 
 	  case SCULL_IOCHQSET:
 		if (! capable(CAP_SYS_ADMIN))
 			return -EPERM;
-		tmp = scull_qset;
-		scull_qset = arg;
-		return tmp;
-
-	  /*
-	   * The following two change the buffer size for scullpipe.
-	   * The scullpipe device uses this same ioctl method, just to
-	   * write less code. Actually, it's the same sriver, isn't it?
-	   */
-	  case SCULL_P_IOCTSIZE:
-		//scull_p_buffer = arg;
+		retval = scull_set_qset(dev, arg, &old);
+		return retval ? retval : old;
+
+	  case SCULL_IOCPUNCH:	/* arg points to a struct scull_range */
+		if (!(filp->f_mode & FMODE_WRITE))
+			return -EBADF;
+		if (copy_from_user(&range, (void __user *)arg, sizeof(range)))
+			return -EFAULT;
+		if (range.offset > LLONG_MAX || range.length > LLONG_MAX)
+			return -EINVAL;
+		return scull_fallocate(filp, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				range.offset, range.length);
+
+	  case SCULL_IOCCTL:
+		return scull_ctl(filp, (struct scull_ctl __user *)arg);
+
+	  case SCULL_IOCSLIMIT:	/* arg points to the new cap */
+		if (!capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (copy_from_user(&limit, (void __user *)arg, sizeof(limit)))
+			return -EFAULT;
+		if (limit > ULONG_MAX)
+			return -EINVAL;
+		/* data already there is kept, only new quanta are refused */
+		WRITE_ONCE(dev->limit, limit);
 		break;
 
-	  case SCULL_P_IOCQSIZE:
-		//return scull_p_buffer;
-		return 0;
+	  case SCULL_IOCGLIMIT:
+		limit = READ_ONCE(dev->limit);
+		if (copy_to_user((void __user *)arg, &limit, sizeof(limit)))
+			return -EFAULT;
+		break;
+
+	  case SCULL_IOCCLONE:	/* arg points to a struct scull_clone */
+		return scull_clone_ioctl(filp, (struct scull_clone __user *)arg);
+
+	  case SCULL_IOCSNAP:	/* the slots are few, and shared by all */
+		if (! capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		if (!(filp->f_mode & FMODE_READ))
+			return -EBADF;
+		return scull_snap_create(dev);
 
 	  default:	/* redundant, as cmd was checked against MAXNR */
 		return -ENOTTY;
@@ -519,6 +1429,379 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	return retval;
 }
 
+/*
+ * Sparse devices: a missing quantum set or quantum is a hole, that
+ * reads as zeroes. Those functions must be called with the device
+ * semaphore held, for writing in the case of scull_punch_hole.
+ */
+
+/* First quantum set at or after "n", or ULONG_MAX if there's none */
+static unsigned long scull_next_set(struct scull_dev *dev, unsigned long n)
+{
+	struct radix_tree_iter iter;
+	void __rcu **slot;
+
+	if (dev->data)
+		radix_tree_for_each_slot(slot, dev->data, &iter, n)
+			return iter.index;
+	return ULONG_MAX;
+}
+
+/*
+ * Find the first byte at or after "off" that is data (or a hole, if
+ * "data" is zero). The end of the device counts as a hole.
+ */
+static loff_t scull_seek_data(struct scull_dev *dev, loff_t off, int data)
+{
+	int quantum = dev->quantum, itemsize = quantum * dev->qset;
+	unsigned long pos = off, item;
+	struct scull_quantum **dptr;
+
+	if (off < 0 || off >= dev->size)
+		return -ENXIO;
+
+	while (pos < dev->size) {
+		item = pos / itemsize;
+		dptr = scull_follow(dev, item);
+		if (dptr == NULL) {	/* the whole set is a hole */
+			if (!data)
+				return pos;
+			item = scull_next_set(dev, item);
+			if (item > dev->size / itemsize)
+				break;
+			pos = item * itemsize;
+			continue;
+		}
+		if (!dptr[(pos % itemsize) / quantum] == !data)
+			return pos;
+		pos = (pos / quantum + 1) * quantum;	/* next quantum */
+	}
+	return data ? -ENXIO : dev->size;
+}
+
+/*
+ * Punch a hole in the device: quanta that fall entirely in the range
+ * are released, and sets that end up empty with them. The size of the
+ * device does not change.
+ */
+static int scull_punch_hole(struct scull_dev *dev, loff_t offset, loff_t len)
+{
+	int quantum = dev->quantum, qset = dev->qset;
+	int itemsize = quantum * qset;
+	unsigned long pos, end, set_end, item;
+	int i, s_pos, q_pos, rest, chunk;
+	struct scull_quantum **dptr, *q;
+
+	if (offset < 0 || len <= 0)
+		return -EINVAL;
+	if (atomic_read(&dev->vmas))	/* mapped pages would go stale */
+		return -EBUSY;
+	if (offset >= dev->size)
+		return 0;	/* nothing there */
+
+	pos = offset;
+	end = dev->size;
+	if (len < end - pos)
+		end = pos + len;
+	while (pos < end) {
+		item = pos / itemsize;
+		set_end = min((item + 1) * itemsize, end);
+		dptr = scull_follow(dev, item);
+		if (dptr == NULL) {
+			pos = set_end;
+			continue;	/* already a hole */
+		}
+		for (; pos < set_end; pos += chunk) {
+			rest = pos % itemsize;
+			s_pos = rest / quantum; q_pos = rest % quantum;
+			chunk = min(set_end - pos, (unsigned long)(quantum - q_pos));
+			if (!dptr[s_pos])
+				continue;
+			/* whole quanta go away, the ends of the range are zeroed */
+			if (q_pos == 0 && (chunk == quantum || pos + chunk >= dev->size)) {
+				scull_put_quantum(dev, dptr[s_pos], quantum);
+				dptr[s_pos] = NULL;
+				continue;
+			}
+			q = scull_writable(dev, &dptr[s_pos]);	/* may be shared */
+			if (IS_ERR(q))
+				return PTR_ERR(q);
+			memset(q->data + q_pos, 0, chunk);
+		}
+		for (i = 0; i < qset && !dptr[i]; i++)
+			;
+		if (i == qset) {	/* the set is empty now */
+			radix_tree_delete(dev->data, item);
+			scull_put_qset(dev, dptr, qset);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Only punching holes is supported: there is no point in preallocating
+ * quanta. Note that the VFS only passes fallocate() on to regular files
+ * and block devices, so for scull the SCULL_IOCPUNCH ioctl does the same.
+ */
+long scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len)
+{
+	struct scull_dev *dev = filp->private_data;
+	long retval;
+
+	if (mode != (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE))
+		return -EOPNOTSUPP;
+	if (scull_down_write(dev))
+		return -ERESTARTSYS;
+	retval = scull_punch_hole(dev, offset, len);
+	up_write(&dev->sem);
+	return retval;
+}
+
+/*
+ * Cloning: copy a range of one bare device to another (or to another
+ * place of the same device). Quanta that line up and are covered
+ * whole are not copied, but shared copy-on-write: the destination
+ * just takes a reference. The rest, and everything when the two
+ * quanta differ in size, is copied.
+ */
+
+/*
+ * The destination is locked for writing, the source for reading, and
+ * always in the same order, lest two opposite clones deadlock.
+ */
+static int scull_lock_pair(struct scull_dev *src, struct scull_dev *dst)
+{
+	if (src == dst)
+		return scull_down_write(dst);
+	if (src < dst)
+		scull_down_read(src);
+	if (scull_down_write(dst)) {
+		if (src < dst)
+			up_read(&src->sem);
+		return -ERESTARTSYS;
+	}
+	if (src > dst)
+		scull_down_read(src);
+	return 0;
+}
+
+static void scull_unlock_pair(struct scull_dev *src, struct scull_dev *dst)
+{
+	if (src != dst)
+		up_read(&src->sem);
+	up_write(&dst->sem);
+}
+
+/*
+ * Must be called with both devices locked. Returns the number of
+ * bytes cloned, which stops short at the end of the source; short of
+ * that, a failure halfway is an error if the range was to be cloned
+ * "whole", and the bytes done otherwise.
+ */
+static ssize_t scull_clone_range(struct scull_dev *src, unsigned long spos,
+		struct scull_dev *dst, unsigned long dpos, size_t len, int whole)
+{
+	int squantum = src->quantum, quantum = dst->quantum;
+	struct scull_quantum **sptr, **dptr, *q, *d;
+	void *data, *buf = NULL;	/* buf: for cold quanta */
+	unsigned long sitem, ditem;
+	int s_pos, s_off, d_pos, d_off;
+	size_t done = 0, chunk;
+	int err = 0;
+
+	if (spos >= src->size)
+		return 0;
+	len = min(len, (size_t)(src->size - spos));
+	if (dpos + len < dpos)
+		return -EINVAL;	/* wraps around */
+	if (src == dst && spos < dpos + len && dpos < spos + len)
+		return -EINVAL;	/* overlapping ranges */
+	if (atomic_read(&dst->vmas))	/* mapped pages would go stale */
+		return -EBUSY;
+
+	while (done < len) {
+		sitem = (spos + done) / ((unsigned long)squantum * src->qset);
+		s_pos = ((spos + done) / squantum) % src->qset;
+		s_off = (spos + done) % squantum;
+		ditem = (dpos + done) / ((unsigned long)quantum * dst->qset);
+		d_pos = ((dpos + done) / quantum) % dst->qset;
+		d_off = (dpos + done) % quantum;
+		chunk = min(len - done, (size_t)(squantum - s_off));
+		chunk = min(chunk, (size_t)(quantum - d_off));
+
+		sptr = scull_follow(src, sitem);
+		q = sptr ? sptr[s_pos] : NULL;
+		dptr = scull_follow(dst, ditem);
+
+		/*
+		 * A whole quantum can be shared; so can the last one of
+		 * the source, if nothing of the destination follows it.
+		 */
+		if (squantum == quantum && s_off == 0 && d_off == 0 &&
+				(chunk == quantum ||
+				 (spos + done + chunk >= src->size &&
+				  dpos + done + chunk >= dst->size))) {
+			if (!q) {	/* a hole clones as a hole */
+				if (dptr && dptr[d_pos]) {
+					scull_put_quantum(dst, dptr[d_pos], quantum);
+					dptr[d_pos] = NULL;
+				}
+				done += chunk;
+				continue;
+			}
+			err = -ENOSPC;
+			if (scull_mem_full(dst, !(dptr && dptr[d_pos]), 0))
+				break;
+			err = -ENOMEM;
+			dptr = scull_follow_alloc(dst, ditem);
+			if (!dptr)
+				break;
+			scull_ref_quantum(dst, q);
+			scull_put_quantum(dst, dptr[d_pos], quantum);
+			dptr[d_pos] = q;
+			scull_stat_inc(dst, shared);
+			done += chunk;
+			continue;
+		}
+
+		/* copy the bytes; a hole over a hole needs nothing */
+		if (q || (dptr && dptr[d_pos])) {
+			err = -ENOMEM;
+			dptr = scull_follow_alloc(dst, ditem);
+			if (!dptr)
+				break;
+			/*
+			 * Making the destination private can't free the
+			 * source quantum, even if they were one and the same:
+			 * it is only copied when someone else refers to it.
+			 */
+			d = scull_writable(dst, &dptr[d_pos]);
+			if (IS_ERR(d)) {
+				err = PTR_ERR(d);
+				break;
+			}
+			if (q) {
+				data = scull_qbytes(q, squantum, &buf);
+				err = -EIO;
+				if (!data)
+					break;
+				memcpy(d->data + d_off, data + s_off, chunk);
+			} else
+				memset(d->data + d_off, 0, chunk);
+		}
+		done += chunk;
+	}
+
+	kfree(buf);
+	if (done && dst->size < dpos + done)
+		dst->size = dpos + done;
+	if (done < len && whole)
+		return err;
+	return done ? done : err;
+}
+
+/*
+ * Clone between two open files, checking that both are bare scull
+ * devices: all of those, whatever their access policy, read through
+ * scull_read_iter.
+ */
+static ssize_t scull_clone_files(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len, int whole)
+{
+	struct scull_dev *src = file_in->private_data;
+	struct scull_dev *dst = file_out->private_data;
+	ssize_t retval;
+
+	if (file_in->f_op->read_iter != scull_read_iter ||
+			file_out->f_op->read_iter != scull_read_iter)
+		return -EXDEV;
+	if (!(file_in->f_mode & FMODE_READ) || !(file_out->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (pos_in < 0 || pos_out < 0)
+		return -EINVAL;
+
+	if (scull_lock_pair(src, dst))
+		return -ERESTARTSYS;
+	retval = scull_clone_range(src, pos_in, dst, pos_out, len, whole);
+	scull_unlock_pair(src, dst);
+	return retval;
+}
+
+/*
+ * The VFS methods. Note that this kernel only calls them for regular
+ * files, so for scull the SCULL_IOCCLONE ioctl is the way in.
+ */
+ssize_t scull_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	if (flags)
+		return -EINVAL;
+	return scull_clone_files(file_in, pos_in, file_out, pos_out, len, 0);
+}
+
+int scull_clone_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, u64 len)
+{
+	ssize_t retval;
+
+	if (len == 0)	/* up to the end of the source */
+		len = SIZE_MAX;
+	/* the caller takes success for the whole range shared */
+	retval = scull_clone_files(file_in, pos_in, file_out, pos_out,
+			min_t(u64, len, SIZE_MAX), 1);
+	return retval < 0 ? retval : 0;
+}
+
+/*
+ * Take a snapshot of "src" into "snap": a clone of the whole device,
+ * sharing all of its quanta. The source is only held for reading, and
+ * only for as long as it takes to share them.
+ */
+int scull_snapshot(struct scull_dev *src, struct scull_dev *snap)
+{
+	ssize_t retval;
+
+	if (scull_lock_pair(src, snap))
+		return -ERESTARTSYS;
+	retval = scull_trim(snap);
+	if (retval)
+		goto out;
+	snap->quantum = src->quantum;
+	snap->qset = src->qset;
+	scull_fit_pools(snap);
+	retval = scull_clone_range(src, 0, snap, 0, src->size, 1);
+	if (retval < 0)		/* no partial snapshots */
+		scull_trim(snap);
+	else
+		retval = 0;
+  out:
+	scull_unlock_pair(src, snap);
+	return retval;
+}
+
+static long scull_clone_ioctl(struct file *filp, struct scull_clone __user *uarg)
+{
+	struct scull_clone args;
+	struct fd src;
+	long retval;
+
+	if (copy_from_user(&args, uarg, sizeof(args)))
+		return -EFAULT;
+	if (args.src_offset > LLONG_MAX || args.dest_offset > LLONG_MAX)
+		return -EINVAL;
+	if (args.length == 0)	/* up to the end of the source */
+		args.length = SIZE_MAX;
+
+	src = fdget(args.src_fd);
+	if (!src.file)
+		return -EBADF;
+	retval = scull_clone_files(src.file, args.src_offset, filp,
+			args.dest_offset, min_t(u64, args.length, SIZE_MAX), 0);
+	fdput(src);
+	return retval;
+}
+
 /*
  * The "extended" operations -- only seek
  */
@@ -538,7 +1821,18 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 		break;
 
 	  case 2:	/* SEEK_END */
+		scull_down_read(dev);
 		newpos = dev->size + off;
+		up_read(&dev->sem);
+		break;
+
+	  case SEEK_DATA:
+	  case SEEK_HOLE:
+		scull_down_read(dev);
+		newpos = scull_seek_data(dev, off, whence == SEEK_DATA);
+		up_read(&dev->sem);
+		if (newpos < 0)
+			return newpos;
 		break;
 
 	  default:	/* can't happen */
@@ -552,8 +1846,15 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 struct file_operations scull_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek = 	scull_llseek,
-	.read = 	scull_read,
-	.write = 	scull_write,
+	.read_iter = 	scull_read_iter,
+	.write_iter = 	scull_write_iter,
+	.mmap =		scull_mmap,
+	.splice_read =	scull_splice_read,
+	.splice_write =	iter_file_splice_write,
+	.fallocate =	scull_fallocate,
+	.copy_file_range = scull_copy_file_range,
+	.clone_file_range = scull_clone_file_range,
+	.unlocked_ioctl = scull_ioctl,
 	.compat_ioctl =	scull_ioctl,
 	.open =		scull_open,
 	.release = 	scull_release,
@@ -576,11 +1877,18 @@ void scull_cleanup_module(void)
 
 	PDEBUG("scull_cleanup_module() is called.\n");
 
+	/* first of all, stop the background work on the devices */
+	scull_shrink_cleanup();
+	scull_compress_cleanup();
+
 	/* Get rid of our char dev entries */
 	if (scull_devices) {
 		for (i = 0; i < scull_nr_devs; i++) {
 			scull_trim(scull_devices + i);
+			scull_drain_pools(scull_devices + i);
 			cdev_del(&scull_devices[i].cdev);
+			scull_stats_unregister(scull_devices + i);
+			scull_mem_unregister(scull_devices + i);
 		}
 		kfree(scull_devices);
 	}
@@ -596,6 +1904,13 @@ void scull_cleanup_module(void)
 	/* and call the cleanup functions for friend devices */
 	scull_p_cleanup();
 	scull_access_cleanup();
+	scull_snap_cleanup();
+
+	/* all quanta are gone by now, so are the caches' users */
+	kmem_cache_destroy(scull_quantum_cache);
+	kmem_cache_destroy(scull_qset_cache);
+	kmem_cache_destroy(scull_qdesc_cache);
+	scull_stats_cleanup();
 }
 
 /*
@@ -604,10 +1919,14 @@ void scull_cleanup_module(void)
 static void scull_setup_cdev(struct scull_dev *dev, int index)
 {
 	int err, devno = MKDEV(scull_major, scull_minor + index);
+	char name[16];
 
 	cdev_init(&dev->cdev, &scull_fops);
 	dev->cdev.owner = THIS_MODULE;
 	dev->cdev.ops = &scull_fops;
+	snprintf(name, sizeof(name), "scull%d", index);
+	if (scull_stats_register(dev, name))	/* the device works without */
+		printk(KERN_NOTICE "scull: no statistics for %s\n", name);
 	err = cdev_add(&dev->cdev, devno, 1);
 	/* Fail gracefully if need be */
 	if (err)
@@ -637,6 +1956,19 @@ int scull_init_module(void)
 		return result;
 	}
 
+	scull_stats_init();
+
+	/*
+	 * The caches are sized for the load-time geometry; a failure here
+	 * is not fatal, the allocators above fall back on kmalloc.
+	 */
+	scull_quantum_cache = kmem_cache_create("scull_quantum", scull_quantum,
+			0, SLAB_HWCACHE_ALIGN, NULL);
+	scull_qset_cache = kmem_cache_create("scull_qset",
+			scull_qset * sizeof(void *), 0, 0, NULL);
+	scull_qdesc_cache = kmem_cache_create("scull_qdesc",
+			sizeof(struct scull_quantum), 0, 0, NULL);
+
 	/*
 	 * allocate the devices -- we can't have them static, as the number
 	 * can be specified at load time.
@@ -652,7 +1984,8 @@ int scull_init_module(void)
 	for (i = 0; i < scull_nr_devs; i++) {
 		scull_devices[i].quantum = scull_quantum;
 		scull_devices[i].qset = scull_qset;
-		sema_init(&scull_devices[i].sem, 1);
+		init_rwsem(&scull_devices[i].sem);
+		scull_mem_register(&scull_devices[i]);
 		scull_setup_cdev(&scull_devices[i], i);
 	}
 
@@ -660,6 +1993,12 @@ int scull_init_module(void)
 	dev = MKDEV(scull_major, scull_minor + scull_nr_devs);
 	dev += scull_p_init(dev);
 	dev += scull_access_init(dev);	
+	dev += scull_snap_init(dev);
+
+	/* without a shrinker, memory is only bounded by the caps */
+	if (scull_shrink_init())
+		printk(KERN_NOTICE "scull: can't register the shrinker\n");
+	scull_compress_init();
 
 #ifdef SCULL_DEBUG	/* only when debugging */
 	scull_create_proc();
@@ -0,0 +1,108 @@
+/*
+ * mmap.c -- memory mapping for the bare scull device
+ *
+ * Only devices whose quantum is exactly one page can be mapped: their
+ * quanta come straight from the page allocator, so each one is a page
+ * that can be inserted in the process page tables.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/mm.h>		/* everything */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+
+/*
+ * open and close: just keep track of how many times the device is
+ * mapped, to avoid releasing it.
+ */
+
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_inc(&dev->vmas);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = vma->vm_private_data;
+
+	atomic_dec(&dev->vmas);
+}
+
+/*
+ * The fault method: look up the quantum backing the faulting page and
+ * hand it to the VM. The count for the page must be incremented,
+ * because it is automatically decremented at unmap time.
+ *
+ * If the device has holes, the process receives a SIGBUS when
+ * accessing the hole, just like it does beyond the end of data.
+ */
+static int scull_vma_fault(struct vm_fault *vmf)
+{
+	struct scull_dev *dev = vmf->vma->vm_private_data;
+	unsigned long pgoff = vmf->pgoff;	/* a quantum number */
+	struct scull_quantum **dptr;
+	void *pageptr = NULL;	/* default to "missing" */
+	int retval = VM_FAULT_SIGBUS;
+
+	scull_down_read(dev);
+	if (dev->quantum != PAGE_SIZE)
+		goto out;
+	if ((loff_t)pgoff << PAGE_SHIFT >= dev->size)
+		goto out;	/* out of range */
+
+	dptr = scull_follow(dev, pgoff / dev->qset);
+	if (dptr && dptr[pgoff % dev->qset])
+		pageptr = dptr[pgoff % dev->qset]->data;
+	if (!pageptr)
+		goto out;	/* hole */
+
+	/* got it, now increment the count */
+	vmf->page = virt_to_page(pageptr);
+	get_page(vmf->page);
+	retval = 0;
+
+  out:
+	up_read(&dev->sem);
+	return retval;
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+	.open =		scull_vma_open,
+	.close =	scull_vma_close,
+	.fault =	scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	/* refuse to map if quanta are not single pages */
+	if (dev->quantum != PAGE_SIZE)
+		return -ENODEV;
+
+	/*
+	 * Mappings are for readers: a shared writable mapping would
+	 * change the data behind the back of dev->size.
+	 */
+	if (vma->vm_flags & VM_SHARED) {
+		if (vma->vm_flags & VM_WRITE)
+			return -EACCES;
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* don't do anything here: "fault" will set up page table entries */
+	vma->vm_ops = &scull_vm_ops;
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_private_data = dev;
+	scull_vma_open(vma);
+	return 0;
+}
@@ -10,25 +10,74 @@
 
 #include <linux/kernel.h>	/* printk(), min() */
 #include <linux/slab.h>		/* kmalloc() */
+#include <linux/mm.h>		/* kvmalloc() */
+#include <linux/vmalloc.h>	/* vmalloc_user() */
 #include <linux/fs.h>		/* everyting... */
 #include <linux/proc_fs.h>
 #include <linux/errno.h>	/* error codes */
+#include <linux/err.h>
 #include <linux/types.h>	/* size_t */
 #include <linux/fcntl.h>
 #include <linux/poll.h>		/* includes wait.h */
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>		/* copy_*_iter */
+#include <linux/highmem.h>	/* kmap() */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/mutex.h>
+#include <linux/list.h>
+#include <linux/timer.h>
+#include <linux/jiffies.h>
 #include <linux/sched/signal.h>
 
 #include "scull.h"		/* local definitions */
 
+/*
+ * The buffer is a single-producer, single-consumer ring: only readers
+ * move "rp", only writers move "wp", and each side publishes its
+ * pointer with release semantics once it is done with the data. So
+ * a reader and a writer never need a lock in common: the readers are
+ * serialized among themselves by "rlock", the writers by "wlock", and
+ * with one reader and one writer neither lock is ever contended. The
+ * semaphore only protects the counts of openings and the allocation of
+ * the buffer; a resize holds both locks instead.
+ *
+ * The pointers are kept as offsets in a struct scull_p_ring: "hdr"
+ * in here, or, once the pipe can be mapped, the page in front of the
+ * data, where user space moves them too.
+ *
+ * In broadcast mode (SCULL_CTL_BCAST), each reader has a cursor of its
+ * own, and "rp" is the cursor of the slowest one: that's all writers
+ * need to know. Readers still move it, one at a time.
+ *
+ * In page mode (SCULL_CTL_PAGES), the data is not in the buffer at
+ * all, but in pages the pipe holds a reference to, one per slot of
+ * "pages", which is a ring too: "pr" and "pw" count the slots read and
+ * written, and they are moved and published like "rp" and "wp".
+ */
+struct scull_p_page {
+	struct page *page;
+	unsigned int offset, len;		/* what is left of its data */
+};
+
 struct scull_pipe {
 	wait_queue_head_t inq, outq;		/* read and write queues */
 	char *buffer, *end;			/* begin of buf, end of buf */
 	int buffersize;				/* used in pointer arithmetic */
-	char *rp, *wp;				/* where to read, where to write */
+	struct scull_p_ring *ring;		/* where to read, where to write */
+	struct scull_p_ring hdr;		/* the ring, unless mappable */
 	int nreaders, nwriters;			/* number of openings for r/w */
 	struct fasync_struct *async_queue;	/* asynchronous readers */
+	unsigned int rlowat, wlowat;		/* bytes to wake readers, writers */
+	unsigned int rdelay;			/* usecs before readers are woken anyway */
+	struct timer_list rtimer;		/* which does it */
+	int packet;				/* records rather than bytes */
+	int bcast, drop;			/* broadcast, drop for the slow */
+	struct list_head readers;		/* their scull_p_file, under rlock */
+	struct scull_p_page *pages;		/* the slots, in page mode */
+	unsigned int npages, pr, pw;		/* how many, read, written */
+	struct mutex rlock, wlock;		/* one reader, one writer at a time */
 	struct semaphore sem;			/* mutual exclusion semaphore */
 	struct cdev cdev;			/* Char device structure */
 };
@@ -36,15 +85,231 @@ struct scull_pipe {
 /* parameters */
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;	/* number of pipe devices */
 int scull_p_buffer = SCULL_P_BUFFER;	/* buffer size */
+static int scull_p_max_buffer = SCULL_P_MAX_BUFFER;	/* resize cap */
 dev_t scull_p_devno;			/* Our first device number */
 
 module_param(scull_p_nr_devs, int, 0);
 module_param(scull_p_buffer, int, 0);
+module_param(scull_p_max_buffer, int, S_IRUGO | S_IWUSR);
 
 static struct scull_pipe *scull_p_devices;
 
+/*
+ * Each opening of a pipe. Readers also have their own cursor, used in
+ * broadcast mode.
+ */
+struct scull_p_file {
+	struct scull_pipe *dev;
+	struct list_head list;		/* the readers of the pipe */
+	u32 rp;				/* where this one reads, broadcasting */
+	unsigned long dropped;		/* bytes it lost for being slow */
+};
+
+static inline struct scull_pipe *scull_p_dev(struct file *filp)
+{
+	return ((struct scull_p_file *)filp->private_data)->dev;
+}
+
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
+
+/* How much space is free, between a read and a write pointer? */
+static int spacefree(struct scull_pipe *dev, char *rp, char *wp)
+{
+	if (rp == wp)
+		return dev->buffersize - 1;
+	return ((rp + dev->buffersize - wp) % dev->buffersize) - 1;
+}
+
+/*
+ * The pointers. Once a new value of the other side is seen, so is the
+ * data written (or the room freed) before it was stored. A mapped
+ * ring can hold anything user space stored there, so an offset is
+ * checked before it is used: garbage makes garbage data, not a stray
+ * access.
+ */
+static inline char *scull_p_ptr(struct scull_pipe *dev, u32 off)
+{
+	if (unlikely(off >= dev->buffersize))
+		off = 0;
+	return dev->buffer + off;
+}
+
+static inline char *scull_p_wp(struct scull_pipe *dev)
+{
+	return scull_p_ptr(dev, smp_load_acquire(&dev->ring->wp));
+}
+
+static inline char *scull_p_rp(struct scull_pipe *dev)
+{
+	return scull_p_ptr(dev, smp_load_acquire(&dev->ring->rp));
+}
+
+static inline void scull_p_set_wp(struct scull_pipe *dev, char *wp)
+{
+	smp_store_release(&dev->ring->wp, (u32)(wp - dev->buffer));
+}
+
+static inline void scull_p_set_rp(struct scull_pipe *dev, char *rp)
+{
+	smp_store_release(&dev->ring->rp, (u32)(rp - dev->buffer));
+}
+
+/* Is there nothing to read? For sleepers, that look without a lock */
+static inline int scull_p_empty(struct scull_pipe *dev)
+{
+	if (READ_ONCE(dev->pages))
+		return READ_ONCE(dev->pr) == READ_ONCE(dev->pw);
+	return READ_ONCE(dev->ring->rp) == READ_ONCE(dev->ring->wp);
+}
+
+/*
+ * Is there room to write? Bytes, or slots in page mode.
+ */
+static inline int scull_p_room(struct scull_pipe *dev)
+{
+	if (READ_ONCE(dev->pages))
+		return dev->npages - (smp_load_acquire(&dev->pw) -
+				smp_load_acquire(&dev->pr));
+	return spacefree(dev, scull_p_rp(dev), scull_p_wp(dev));
+}
+
+/*
+ * Where a reader reads, and the same without the read lock, for
+ * sleepers. Moving its cursor may move "rp", as it may have been the
+ * slowest reader; a cursor that goes away too.
+ */
+static inline char *scull_p_rd_rp(struct scull_pipe *dev,
+		struct scull_p_file *pf)
+{
+	if (dev->bcast)
+		return scull_p_ptr(dev, pf->rp);
+	return scull_p_rp(dev);
+}
+
+static inline int scull_p_rd_empty(struct scull_pipe *dev,
+		struct scull_p_file *pf)
+{
+	if (READ_ONCE(dev->bcast))
+		return READ_ONCE(pf->rp) == READ_ONCE(dev->ring->wp);
+	return scull_p_empty(dev);
+}
+
+static void scull_p_bcast_sync(struct scull_pipe *dev)
+{
+	struct scull_p_file *pf;
+	char *wp = scull_p_wp(dev), *rp = NULL;
+	int left, most = -1;
+
+	list_for_each_entry(pf, &dev->readers, list) {
+		left = dev->buffersize - 1 -
+				spacefree(dev, scull_p_ptr(dev, pf->rp), wp);
+		if (left > most) {
+			most = left;
+			rp = scull_p_ptr(dev, pf->rp);
+		}
+	}
+	if (rp)
+		scull_p_set_rp(dev, rp);
+}
+
+static void scull_p_rd_set_rp(struct scull_pipe *dev, struct scull_p_file *pf,
+		char *rp)
+{
+	if (dev->bcast) {
+		WRITE_ONCE(pf->rp, rp - dev->buffer);
+		scull_p_bcast_sync(dev);
+	} else {
+		scull_p_set_rp(dev, rp);
+	}
+}
+
+/*
+ * Let go of the pages in the slots from "pr" to "pw".
+ */
+static void scull_p_put_pages(struct scull_pipe *dev, unsigned int pr,
+		unsigned int pw)
+{
+	struct scull_p_page *pp;
+
+	for (; pr != pw; pr++) {
+		pp = dev->pages + pr % dev->npages;
+		put_page(pp->page);
+		pp->page = NULL;
+	}
+}
+
+/*
+ * Free the buffer, and the ring page in front of it if it has one; in
+ * page mode, the slots and what they hold too.
+ */
+static void scull_p_free_buffer(struct scull_pipe *dev)
+{
+	if (dev->pages) {
+		scull_p_put_pages(dev, dev->pr, dev->pw);
+		kfree(dev->pages);
+		dev->pages = NULL;
+	}
+	if (dev->ring && dev->ring != &dev->hdr)
+		vfree(dev->ring);
+	else
+		kvfree(dev->buffer);
+	dev->buffer = NULL;
+	dev->ring = NULL;
+}
+
+/*
+ * Wakeups. Readers are only woken once "rlowat" bytes are there, and
+ * a trickle of smaller writes is left to the timer, so that it costs
+ * one wakeup rather than one each; writers are only woken once
+ * "wlowat" bytes are free. A full (or empty) buffer always wakes the
+ * other side, or it could wait forever. Nobody is woken if nobody
+ * sleeps; the barrier in wq_has_sleeper pairs with the one sleepers
+ * have between queueing themselves and looking at the pointers. The
+ * wakeups carry the event as their key, for epoll to filter on.
+ */
+static inline void scull_p_wake_in(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->inq, POLLIN | POLLRDNORM);
+}
+
+static inline void scull_p_wake_out(struct scull_pipe *dev)
+{
+	wake_up_interruptible_poll(&dev->outq, POLLOUT | POLLWRNORM);
+}
+
+static void scull_p_wake_readers(struct scull_pipe *dev)
+{
+	if (wq_has_sleeper(&dev->inq))
+		scull_p_wake_in(dev);	/* blocked in read() and select() */
+
+	/* and signal asynchronous readers, explained late in chapter 5 */
+	if (dev->async_queue)
+		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+static void scull_p_rtimer_fn(struct timer_list *t)
+{
+	struct scull_pipe *dev = from_timer(dev, t, rtimer);
+
+	scull_p_wake_readers(dev);
+}
+
+static void scull_p_wrote(struct scull_pipe *dev, int used)
+{
+	if (used >= min_t(unsigned int, READ_ONCE(dev->rlowat), dev->buffersize - 1))
+		scull_p_wake_readers(dev);
+	else if (!timer_pending(&dev->rtimer))
+		mod_timer(&dev->rtimer,
+				jiffies + usecs_to_jiffies(READ_ONCE(dev->rdelay)) + 1);
+}
+
+static void scull_p_read_done(struct scull_pipe *dev, int free)
+{
+	if (free < min_t(unsigned int, READ_ONCE(dev->wlowat), dev->buffersize - 1))
+		return;
+	if (wq_has_sleeper(&dev->outq))
+		scull_p_wake_out(dev);
+}
 
 /*
  * Open and close
@@ -53,33 +318,55 @@ static int spacefree(struct scull_pipe *dev);
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
 	struct scull_pipe *dev;
+	struct scull_p_file *pf;
 
 	dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-	filp->private_data = dev;
+	pf = kmalloc(sizeof(struct scull_p_file), GFP_KERNEL);
+	if (!pf)
+		return -ENOMEM;
+	memset(pf, 0, sizeof(struct scull_p_file));
+	pf->dev = dev;
+	INIT_LIST_HEAD(&pf->list);
+	filp->private_data = pf;
 
 	PDEBUG("scull_p_open() is called\n");
 
-	if (down_interruptible(&dev->sem))
+	if (down_interruptible(&dev->sem)) {
+		kfree(pf);
 		return -ERESTARTSYS;
+	}
 	if (!dev->buffer) {
 		/* allocate the buffer */
-		dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+		dev->buffer = kvmalloc(scull_p_buffer, GFP_KERNEL);
 		if (!dev->buffer) {
 			up(&dev->sem);
+			kfree(pf);
 			return -ENOMEM;
 		}
 
 		dev->buffersize = scull_p_buffer;
 		dev->end = dev->buffer + dev->buffersize;
-		dev->rp = dev->wp = dev->buffer;	/* rd and wr from the beginning */
+		dev->ring = &dev->hdr;
+		dev->hdr.rp = dev->hdr.wp = 0;	/* rd and wr from the beginning */
+		dev->hdr.size = dev->buffersize;
+		dev->rlowat = dev->wlowat = 1;	/* wake up at every transfer */
+		dev->rdelay = 0;
+		dev->packet = 0;
+		dev->bcast = dev->drop = 0;
 	}
 	//dev->buffersize = scull_p_buffer;
 	//dev->end = dev->buffer + dev->buffersize;
 	//dev->rp = dev->wp = dev->buffer;	/* rd and wr from the beginning */
 
 	/* use f_mode, not f_flags: it's cleaner (fs/open.c tells why) */
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders++;
+		/* a new reader starts with whatever is still there */
+		mutex_lock(&dev->rlock);
+		pf->rp = READ_ONCE(dev->ring->rp);
+		list_add_tail(&pf->list, &dev->readers);
+		mutex_unlock(&dev->rlock);
+	}
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters++;
 	up(&dev->sem);
@@ -89,163 +376,1100 @@ static int scull_p_open(struct inode *inode, struct file *filp)
 
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 
 	PDEBUG("scull_p_release() is called\n");
 
 	/* remove this filp from the asynchronously notified filp's */
 	scull_p_fasync(-1, filp, 0);
 	down(&dev->sem);
-	if (filp->f_mode & FMODE_READ)
+	if (filp->f_mode & FMODE_READ) {
 		dev->nreaders--;
+		mutex_lock(&dev->rlock);
+		list_del(&pf->list);
+		if (dev->bcast)	/* it may have been holding writers back */
+			scull_p_bcast_sync(dev);
+		mutex_unlock(&dev->rlock);
+		scull_p_wake_out(dev);
+	}
 	if (filp->f_mode & FMODE_WRITE)
 		dev->nwriters--;
-	if (dev->nreaders + dev->nwriters == 0) {
-		kfree(dev->buffer);
-		dev->buffer = NULL;	/* the other fields are not checked on open */
-	}
+	if (dev->nreaders + dev->nwriters == 0)
+		scull_p_free_buffer(dev);	/* the other fields are not checked on open */
 	up(&dev->sem);
+	kfree(pf);
 	return 0;
 }
 
 /*
  * Data management: read and write
+ *
+ * In packet mode (SCULL_CTL_PACKET), each write is one record in the
+ * ring: its length as a u32, then the data, both possibly wrapping
+ * around the end of the buffer. A record is published whole, so a
+ * reader always finds whole records between rp and wp.
  */
 
-static ssize_t scull_p_read (struct file *filp, char __user *buf, size_t count,
-		loff_t *pos)
+/* Move a pointer "n" bytes forward in the ring */
+static char *scull_p_advance(struct scull_pipe *dev, char *p, size_t n)
 {
-	struct scull_pipe *dev = filp->private_data;
+	p += n;
+	if (p >= dev->end)
+		p -= dev->buffersize;	/* wrapped */
+	return p;
+}
 
-	if (down_interruptible(&dev->sem))
-		return -ERESTARTSYS;
+/* Copy "n" bytes out of the ring, or into it, across the end if need be */
+static char *scull_p_peek(struct scull_pipe *dev, char *rp, void *dst, size_t n)
+{
+	size_t chunk = min(n, (size_t)(dev->end - rp));
+
+	memcpy(dst, rp, chunk);
+	memcpy(dst + chunk, dev->buffer, n - chunk);
+	return scull_p_advance(dev, rp, n);
+}
+
+static char *scull_p_poke(struct scull_pipe *dev, char *wp, const void *src,
+		size_t n)
+{
+	size_t chunk = min(n, (size_t)(dev->end - wp));
+
+	memcpy(wp, src, chunk);
+	memcpy(dev->buffer, src + chunk, n - chunk);
+	return scull_p_advance(dev, wp, n);
+}
 
-	while (dev->rp == dev->wp) {	/* nothing to read */
-		up(&dev->sem);	/* release the lock */
+/*
+ * The same, from and to user space, which may be many buffers (readv,
+ * writev): either way, a transfer across the end of the ring is one
+ * call. They return the bytes copied.
+ */
+static size_t scull_p_to_iter(struct scull_pipe *dev, char *rp, size_t n,
+		struct iov_iter *to)
+{
+	size_t chunk = min(n, (size_t)(dev->end - rp));
+	size_t copied = copy_to_iter(rp, chunk, to);
+
+	if (copied == chunk && n > chunk)
+		copied += copy_to_iter(dev->buffer, n - chunk, to);
+	return copied;
+}
+
+static size_t scull_p_from_iter(struct scull_pipe *dev, char *wp, size_t n,
+		struct iov_iter *from)
+{
+	size_t chunk = min(n, (size_t)(dev->end - wp));
+	size_t copied = copy_from_iter(wp, chunk, from);
+
+	if (copied == chunk && n > chunk)
+		copied += copy_from_iter(dev->buffer, n - chunk, from);
+	return copied;
+}
+
+/*
+ * In page mode, a read copies out of as many slots as it can, and lets
+ * go of each page it empties; a write copies into new pages, one to a
+ * slot, as many as there are free. With the read (write) lock held;
+ * they return the bytes copied.
+ */
+static size_t scull_p_pages_to_iter(struct scull_pipe *dev, struct iov_iter *to)
+{
+	unsigned int pr = dev->pr, pw = smp_load_acquire(&dev->pw);
+	struct scull_p_page *pp;
+	size_t n, copied, total = 0;
+
+	while (pr != pw && iov_iter_count(to)) {
+		pp = dev->pages + pr % dev->npages;
+		n = min(iov_iter_count(to), (size_t)pp->len);
+		copied = copy_page_to_iter(pp->page, pp->offset, n, to);
+		pp->offset += copied;
+		pp->len -= copied;
+		total += copied;
+		if (copied < n)
+			break;	/* a fault */
+		if (!pp->len) {
+			put_page(pp->page);
+			pp->page = NULL;
+			pr++;
+		}
+	}
+	smp_store_release(&dev->pr, pr);
+	return total;
+}
+
+static size_t scull_p_pages_from_iter(struct scull_pipe *dev,
+		struct iov_iter *from)
+{
+	unsigned int pw = dev->pw, pr = smp_load_acquire(&dev->pr);
+	struct scull_p_page *pp;
+	struct page *page;
+	size_t n, copied, total = 0;
+
+	while (pw - pr < dev->npages && iov_iter_count(from)) {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			break;
+		n = min(iov_iter_count(from), PAGE_SIZE);
+		copied = copy_page_from_iter(page, 0, n, from);
+		if (!copied) {
+			put_page(page);
+			break;	/* a fault */
+		}
+		pp = dev->pages + pw % dev->npages;
+		pp->page = page;
+		pp->offset = 0;
+		pp->len = copied;
+		pw++;
+		total += copied;
+		if (copied < n)
+			break;
+	}
+	smp_store_release(&dev->pw, pw);
+	return total;
+}
+
+/* Wait for data to read; caller must hold the read lock. On
+ * error the lock will be released before returning. */
+static int scull_getreaddata(struct scull_pipe *dev, struct file *filp)
+{
+	struct scull_p_file *pf = filp->private_data;
+
+	while (scull_p_rd_empty(dev, pf)) {	/* nothing to read */
+		mutex_unlock(&dev->rlock);	/* release the lock */
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;
 		PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-		if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
+		if (wait_event_interruptible(dev->inq, !scull_p_rd_empty(dev, pf)))
 			return -ERESTARTSYS;	/* signal: tell the fs layer to handle it */
 		/* otherwise loop, but first reacquire the lock */
-		if (down_interruptible(&dev->sem))
-			return ERESTARTSYS;
+		if (mutex_lock_interruptible(&dev->rlock))
+			return -ERESTARTSYS;
 	}
+	return 0;
+}
+
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *filp = iocb->ki_filp;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	size_t count = iov_iter_count(to);
+	char *rp, *wp;
+	int result, free;
+	u32 len;
+
+	if (count == 0)
+		return 0;	/* nor would a record be lost to it */
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+
+	result = scull_getreaddata(dev, filp);
+	if (result)
+		return result;	/* scull_getreaddata released the lock */
+
 	/* ok, data is there, return something */
-	if (dev->wp > dev->rp)
-		count = min(count, (size_t)(dev->wp - dev->rp));
-	else	/* the writer point has wrapped, return data up to dev->end */
-		count = min(count, (size_t)(dev->end - dev->rp));
-	if (copy_to_user(buf, dev->rp, count)) {
-		up(&dev->sem);
-		return -EFAULT;
+	if (dev->pages) {
+		count = scull_p_pages_to_iter(dev, to);
+		mutex_unlock(&dev->rlock);
+		if (!count && iov_iter_count(to))
+			return -EFAULT;
+		scull_p_read_done(dev, INT_MAX);	/* a slot is free */
+		return count;
+	}
+	rp = scull_p_rd_rp(dev, pf);
+	wp = scull_p_wp(dev);
+	if (dev->packet) {
+		/* one record: what doesn't fit in the buffer is lost */
+		rp = scull_p_peek(dev, rp, &len, sizeof(len));
+		count = min(count, (size_t)len);
+		if (scull_p_to_iter(dev, rp, count, to) != count) {
+			mutex_unlock(&dev->rlock);
+			return -EFAULT;
+		}
+		rp = scull_p_advance(dev, rp, len);
+	} else {
+		/* all there is, in two pieces if the writer has wrapped */
+		count = min(count, (size_t)(dev->buffersize - 1 -
+				spacefree(dev, rp, wp)));
+		count = scull_p_to_iter(dev, rp, count, to);
+		if (!count && iov_iter_count(to)) {
+			mutex_unlock(&dev->rlock);
+			return -EFAULT;	/* a partial copy still counts */
+		}
+		rp = scull_p_advance(dev, rp, count);
 	}
-	dev->rp += count;
-	if (dev->rp == dev->end)	
-		dev->rp = dev->buffer;	/* wrapped */
-	up (&dev->sem);
+	scull_p_rd_set_rp(dev, pf, rp);	/* the writer may have the room */
+	free = spacefree(dev, scull_p_rp(dev), wp);	/* at most: wp may have moved on */
+	mutex_unlock(&dev->rlock);
 
 	/* finally, awake any writers and return */
-	wake_up_interruptible(&dev->outq);
+	scull_p_read_done(dev, free);
 	PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
 	return count;
 }
 
-/* Wait for space for writing; caller must hold device semaphore. On
- * error the semaphore will be released before returning. */
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/*
+ * Move a cursor forward until at most "keep" bytes are left to read
+ * from it, whole records at a time in packet mode; returns how many
+ * bytes it skipped.
+ */
+static int scull_p_skip(struct scull_pipe *dev, char **rpp, char *wp, int keep)
+{
+	char *rp = *rpp;
+	int n, skipped = 0;
+	int left = dev->buffersize - 1 - spacefree(dev, rp, wp);
+	u32 len;
+
+	while (left > keep) {
+		n = left - keep;
+		if (dev->packet) {
+			scull_p_peek(dev, rp, &len, sizeof(len));
+			n = sizeof(len) + len;
+		}
+		rp = scull_p_advance(dev, rp, n);
+		left -= n;
+		skipped += n;
+	}
+	*rpp = rp;
+	return skipped;
+}
+
+/*
+ * Make room for "need" bytes, in broadcast mode with SCULL_CTL_DROP:
+ * the readers that lag too far behind lose their oldest data, rather
+ * than hold the writer back. Called with the write lock held, so wp
+ * stays put.
+ */
+static int scull_p_drop(struct scull_pipe *dev, int need)
 {
-	while (spacefree(dev) == 0) {	/* full */
+	struct scull_p_file *pf;
+	char *rp, *wp = scull_p_wp(dev);
+	int keep = dev->buffersize - 1 - need;
+
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	if (list_empty(&dev->readers)) {	/* nobody would read it anyway */
+		rp = scull_p_rp(dev);
+		scull_p_skip(dev, &rp, wp, keep);
+		scull_p_set_rp(dev, rp);
+	}
+	list_for_each_entry(pf, &dev->readers, list) {
+		rp = scull_p_ptr(dev, pf->rp);
+		pf->dropped += scull_p_skip(dev, &rp, wp, keep);
+		WRITE_ONCE(pf->rp, rp - dev->buffer);
+	}
+	scull_p_bcast_sync(dev);
+	mutex_unlock(&dev->rlock);
+	return 0;
+}
+
+/* Wait for "need" bytes of space for writing; caller must hold the
+ * write lock. On error the lock will be released before returning. */
+static int scull_getwritespace(struct scull_pipe *dev, struct file *filp,
+		size_t need)
+{
+	while (scull_p_room(dev) < need) {	/* full */
 		DEFINE_WAIT(wait);
 
-		up(&dev->sem);
+		if (need > dev->buffersize - 1) {
+			mutex_unlock(&dev->wlock);
+			return -EMSGSIZE;	/* a record that will never fit */
+		}
+		if (dev->bcast && dev->drop) {	/* make room instead */
+			if (scull_p_drop(dev, need)) {
+				mutex_unlock(&dev->wlock);
+				return -ERESTARTSYS;
+			}
+			continue;
+		}
+		mutex_unlock(&dev->wlock);
 		if (filp->f_flags & O_NONBLOCK)
 			return -EAGAIN;	
 		PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
 		prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-		if (spacefree(dev) == 0)
+		if (scull_p_room(dev) < need)
 			schedule();
 		finish_wait(&dev->outq, &wait);
 		if (signal_pending(current))
 			return -ERESTARTSYS;
-		if (down_interruptible(&dev->sem))
+		if (mutex_lock_interruptible(&dev->wlock))
 			return -ERESTARTSYS;
 	}
 	return 0;
 }
 
-/* How much space is free? */
-static int spacefree(struct scull_pipe *dev)
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	if (dev->rp == dev->wp)
-		return dev->buffersize - 1;
-	return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
-}
-
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count,
-		loff_t *f_pos)
-{
-	struct scull_pipe *dev = filp->private_data;
-	int result;
-
-	if (down_interruptible(&dev->sem))
+	struct file *filp = iocb->ki_filp;
+	struct scull_pipe *dev = scull_p_dev(filp);
+	size_t count = iov_iter_count(from);
+	size_t need = 1;
+	char *rp, *wp;
+	int result, used;
+	u32 len;
+
+	if (mutex_lock_interruptible(&dev->wlock))
 		return -ERESTARTSYS;
+	if (dev->packet && count == 0) {
+		mutex_unlock(&dev->wlock);
+		return 0;	/* no empty records: they would read as EOF */
+	}
 
-	/* Make sure there's space to write */
-	result = scull_getwritespace(dev, filp);
+	/*
+	 * Make sure there's space to write, all of it for a record; when
+	 * room is made by dropping data, make it for the whole write.
+	 */
+	if (dev->packet)
+		need = count + sizeof(len);
+	else if (dev->bcast && dev->drop)
+		need = clamp_t(size_t, count, 1, dev->buffersize - 1);
+	result = scull_getwritespace(dev, filp, need);
 	if (result)
-		return result;	/* scull_getwritespace called up(&dev->sem) */
+		return result;	/* scull_getwritespace released the lock */
 
 	/* ok, space is there, accept something */
-	count = min(count, (size_t)spacefree(dev));
-	if (dev->wp >= dev->rp)
-		count = min(count, (size_t)(dev->end - dev->wp));	/* to end of buf */
-	else	/* the write pointer has wrapped, fill up to rp - 1 */
-		count = min(count, (size_t)(dev->rp - dev->wp - 1));
-	PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-	if (copy_from_user(dev->wp, buf, count)) {
-		up (&dev->sem);
-		return -EFAULT;
+	if (dev->pages) {
+		count = scull_p_pages_from_iter(dev, from);
+		mutex_unlock(&dev->wlock);
+		if (!count && iov_iter_count(from))
+			return -EFAULT;	/* or no page to be had */
+		scull_p_wrote(dev, INT_MAX);	/* a page is a lot */
+		return count;
 	}
-	dev->wp += count;
-	if (dev->wp == dev->end)
-		dev->wp = dev->buffer;	/* wrapped */
-	up(&dev->sem);
+	rp = scull_p_rp(dev);
+	wp = scull_p_wp(dev);
+	if (dev->packet) {
+		len = count;
+		wp = scull_p_poke(dev, wp, &len, sizeof(len));
+		if (scull_p_from_iter(dev, wp, count, from) != count) {
+			mutex_unlock(&dev->wlock);
+			return -EFAULT;
+		}
+		wp = scull_p_advance(dev, wp, count);
+	} else {
+		/* all the room, in two pieces if it wraps up to rp - 1 */
+		count = min(count, (size_t)spacefree(dev, rp, wp));
+		PDEBUG("Going to accept %li bytes to %p\n", (long)count, wp);
+		count = scull_p_from_iter(dev, wp, count, from);
+		if (!count && iov_iter_count(from)) {
+			mutex_unlock(&dev->wlock);
+			return -EFAULT;	/* a partial copy still counts */
+		}
+		wp = scull_p_advance(dev, wp, count);
+	}
+	scull_p_set_wp(dev, wp);	/* the data is there for readers */
+	used = dev->buffersize - 1 - spacefree(dev, rp, wp);	/* at most */
+	mutex_unlock(&dev->wlock);
 
 	/* finally, awake any reader */
-	wake_up_interruptible(&dev->inq);	/* blocked in read() and select() */
-
-	/* and signal asynchronous readers, explained late in chapter 5 */
-	if (dev->async_queue)
-		kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+	scull_p_wrote(dev, used);
 	PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)count);
 	return count;
 }
 
+/*
+ * Splicing. In page mode, the pages themselves go from the pipe to
+ * the slots and back, rather than their data: a page gifted with
+ * vmsplice(SPLICE_F_GIFT) into a pipe, and spliced from there with
+ * SPLICE_F_MOVE, is stolen as it is; others are copied, as their owner
+ * could still change them. On the way out, the pipe gets the slots'
+ * references, and whoever reads it can steal the pages in turn. Out of
+ * page mode, both ways go through read_iter and write_iter.
+ */
+static const struct pipe_buf_operations scull_p_buf_ops = {
+	.can_merge = 0,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+static void scull_p_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+static ssize_t scull_p_splice_read(struct file *filp, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &scull_p_buf_ops,
+		.spd_release = scull_p_spd_release,
+	};
+	struct scull_p_page *pp;
+	unsigned int pr, pw, max;
+	size_t n;
+	ssize_t retval;
+
+	if (!READ_ONCE(dev->pages))
+		return generic_file_splice_read(filp, ppos, pipe, len, flags);
+	if (!pipe->readers) {
+		send_sig(SIGPIPE, current, 0);
+		return -EPIPE;
+	}
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	retval = scull_getreaddata(dev, filp);
+	if (retval)
+		return retval;	/* scull_getreaddata released the lock */
+	if (!dev->pages) {	/* back to bytes meanwhile */
+		mutex_unlock(&dev->rlock);
+		return generic_file_splice_read(filp, ppos, pipe, len, flags);
+	}
+
+	/*
+	 * Take no more than the pipe has room for (it is locked): what
+	 * splice_to_pipe can't place is lost, as it has left the slots.
+	 */
+	max = min_t(unsigned int, PIPE_DEF_BUFFERS, pipe->buffers - pipe->nrbufs);
+	pr = dev->pr;
+	pw = smp_load_acquire(&dev->pw);
+	while (len && pr != pw && spd.nr_pages < max) {
+		pp = dev->pages + pr % dev->npages;
+		n = min(len, (size_t)pp->len);
+		pages[spd.nr_pages] = pp->page;
+		partial[spd.nr_pages].offset = pp->offset;
+		partial[spd.nr_pages].len = n;
+		spd.nr_pages++;
+		len -= n;
+		if (n < pp->len) {	/* the rest stays: the pipe needs a reference */
+			get_page(pp->page);
+			pp->offset += n;
+			pp->len -= n;
+			break;
+		}
+		pp->page = NULL;	/* the pipe has ours */
+		pr++;
+	}
+	smp_store_release(&dev->pr, pr);
+	mutex_unlock(&dev->rlock);
+
+	if (!spd.nr_pages)
+		return 0;
+	retval = splice_to_pipe(pipe, &spd);
+	scull_p_read_done(dev, INT_MAX);
+	return retval;
+}
+
+/*
+ * Called by splice_from_pipe for each buffer of the pipe, with the
+ * write lock held; returns how much it took, 0 once the slots are full.
+ */
+static int scull_p_splice_actor(struct pipe_inode_info *pipe,
+		struct pipe_buffer *buf, struct splice_desc *sd)
+{
+	struct scull_pipe *dev = scull_p_dev(sd->u.file);
+	struct scull_p_page *pp;
+	struct page *page;
+	unsigned int offset = 0;
+	void *src;
+
+	if (dev->pw - smp_load_acquire(&dev->pr) >= dev->npages)
+		return 0;
+	if (sd->len == buf->len && (sd->flags & SPLICE_F_MOVE) &&
+			!pipe_buf_steal(pipe, buf)) {
+		page = buf->page;	/* ours: the pipe drops its own reference */
+		get_page(page);
+		unlock_page(page);	/* stealing locks it */
+		offset = buf->offset;
+	} else {
+		page = alloc_page(GFP_KERNEL);
+		if (!page)
+			return -ENOMEM;
+		src = kmap(buf->page);
+		memcpy(page_address(page), src + buf->offset, sd->len);
+		kunmap(buf->page);
+	}
+	pp = dev->pages + dev->pw % dev->npages;
+	pp->page = page;
+	pp->offset = offset;
+	pp->len = sd->len;
+	smp_store_release(&dev->pw, dev->pw + 1);
+	return sd->len;
+}
+
+static ssize_t scull_p_splice_write(struct pipe_inode_info *pipe,
+		struct file *filp, loff_t *ppos, size_t len, unsigned int flags)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	ssize_t retval;
+
+	if (!READ_ONCE(dev->pages))
+		return iter_file_splice_write(pipe, filp, ppos, len, flags);
+	if (mutex_lock_interruptible(&dev->wlock))
+		return -ERESTARTSYS;
+	retval = scull_getwritespace(dev, filp, 1);
+	if (retval)
+		return retval;	/* scull_getwritespace released the lock */
+	if (!dev->pages) {	/* back to bytes meanwhile */
+		mutex_unlock(&dev->wlock);
+		return iter_file_splice_write(pipe, filp, ppos, len, flags);
+	}
+	retval = splice_from_pipe(pipe, filp, ppos, len, flags,
+			scull_p_splice_actor);
+	mutex_unlock(&dev->wlock);
+
+	if (retval > 0)
+		scull_p_wrote(dev, INT_MAX);
+	return retval;
+}
+
 static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
 	unsigned int mask = 0;
 
+	/*
+	 * Only wait on the queues this opening can get events from. Not
+	 * only on those asked for: epoll registers once, and a later
+	 * EPOLL_CTL_MOD asking for more never queues it anywhere new. As
+	 * the wakeups say what they are about, epoll still ignores those
+	 * it was not asked for.
+	 */
+	if (filp->f_mode & FMODE_READ)
+		poll_wait(filp, &dev->inq, wait);
+	if (filp->f_mode & FMODE_WRITE)
+		poll_wait(filp, &dev->outq, wait);
+	smp_mb();	/* queued before looking: pairs with wq_has_sleeper */
+
 	/*
 	 * The buffer is circular; it is considered full
 	 * if "wp" is right behind "rp" and empty if the
-	 * two are equal.
+	 * two are equal. No lock is needed to look at them:
+	 * a pointer that moves on afterwards comes with a
+	 * wakeup.
 	 */
-	down(&dev->sem);
-	poll_wait(filp, &dev->inq, wait);
-	poll_wait(filp, &dev->outq, wait);
-	if (dev->rp != dev->wp)
+	if (filp->f_mode & FMODE_READ && !scull_p_rd_empty(dev, pf))
 		mask |= POLLIN | POLLRDNORM;	/* readable */
-	if (spacefree(dev))
+	if (filp->f_mode & FMODE_WRITE && scull_p_room(dev))
 		mask |= POLLOUT | POLLWRNORM;	/* writable */
-	up(&dev->sem);
 	return mask;
 }
 
+/*
+ * Empty the pipe, for all the readers; called with the read lock held.
+ */
+static void scull_p_trim(struct scull_pipe *dev)
+{
+	struct scull_p_file *pf;
+	unsigned int pw;
+	char *wp;
+
+	if (dev->pages) {
+		pw = smp_load_acquire(&dev->pw);
+		scull_p_put_pages(dev, dev->pr, pw);
+		smp_store_release(&dev->pr, pw);
+		return;
+	}
+	wp = scull_p_wp(dev);
+	list_for_each_entry(pf, &dev->readers, list)
+		WRITE_ONCE(pf->rp, wp - dev->buffer);
+	scull_p_set_rp(dev, wp);
+}
+
+/*
+ * Move the data to the start of a new buffer, with both sides locked
+ * out; returns how much there is.
+ */
+static int scull_p_straighten(struct scull_pipe *dev, char *buffer)
+{
+	char *rp = scull_p_rp(dev), *wp = scull_p_wp(dev);
+	int used = dev->buffersize - 1 - spacefree(dev, rp, wp);
+
+	if (wp >= rp) {
+		memcpy(buffer, rp, used);
+	} else {
+		memcpy(buffer, rp, dev->end - rp);
+		memcpy(buffer + (dev->end - rp), dev->buffer, wp - dev->buffer);
+	}
+	return used;
+}
+
+/*
+ * Resize the buffer of an open pipe. The data in it is kept, so it
+ * can't shrink below what it holds. Only writers may do it. The new
+ * buffer is allocated first, then both sides are locked out while the
+ * data moves, writers first: readers never wait for a writer.
+ */
+static char *scull_p_new_buffer(struct file *filp, unsigned long size)
+{
+	char *buffer;
+
+	if (!(filp->f_mode & FMODE_WRITE))
+		return ERR_PTR(-EBADF);
+	if (size < 2 || size > INT_MAX)
+		return ERR_PTR(-EINVAL);	/* a pipe needs 2 bytes */
+	if (size > scull_p_max_buffer && !capable(CAP_SYS_RESOURCE))
+		return ERR_PTR(-EPERM);
+	buffer = kvmalloc(size, GFP_KERNEL);
+	if (!buffer)
+		return ERR_PTR(-ENOMEM);
+	return buffer;
+}
+
+/*
+ * With both locks held: move to "*bufferp", of "size" bytes. Whichever
+ * buffer is not in use afterwards is left in "*bufferp" for the
+ * caller to free, once the locks are released.
+ */
+static int __scull_p_resize(struct scull_pipe *dev, char **bufferp, int size)
+{
+	struct scull_p_file *pf;
+	int used;
+
+	if (dev->ring != &dev->hdr)
+		return -EBUSY;	/* it may be mapped */
+	if (dev->pages)
+		return -EBUSY;	/* the slots don't move */
+	used = dev->buffersize - 1 - spacefree(dev, scull_p_rp(dev),
+			scull_p_wp(dev));
+	if (used >= size)
+		return -EBUSY;	/* like F_SETPIPE_SZ */
+	used = scull_p_straighten(dev, *bufferp);
+	list_for_each_entry(pf, &dev->readers, list)	/* rp is now 0 */
+		pf->rp = (pf->rp + dev->buffersize - dev->hdr.rp) % dev->buffersize;
+	swap(*bufferp, dev->buffer);
+	dev->buffersize = size;
+	dev->end = dev->buffer + size;
+	dev->hdr.size = size;
+	WRITE_ONCE(dev->hdr.rp, 0);
+	WRITE_ONCE(dev->hdr.wp, used);
+	return 0;
+}
+
+/* The pointers moved under the sleepers */
+static void scull_p_resized(struct scull_pipe *dev)
+{
+	scull_p_wake_in(dev);
+	scull_p_wake_out(dev);
+}
+
+static int scull_p_resize(struct file *filp, unsigned long size)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	char *buffer = scull_p_new_buffer(filp, size);
+	int retval;
+
+	if (IS_ERR(buffer))
+		return PTR_ERR(buffer);
+	if (mutex_lock_interruptible(&dev->wlock)) {
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	if (mutex_lock_interruptible(&dev->rlock)) {
+		mutex_unlock(&dev->wlock);
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	retval = __scull_p_resize(dev, &buffer, size);
+	mutex_unlock(&dev->rlock);
+	mutex_unlock(&dev->wlock);
+	kvfree(buffer);
+	if (retval == 0)
+		scull_p_resized(dev);
+	return retval;
+}
+
+/*
+ * Go in and out of page mode, with both sides locked out and the pipe
+ * empty. The slots cover as many pages as the buffer does, and at
+ * least as many as a pipe has; the buffer itself is simply not used
+ * until the pipe goes back to bytes.
+ */
+static int scull_p_set_pages(struct scull_pipe *dev, int on)
+{
+	struct scull_p_page *pages;
+	int n;
+
+	if (!on) {
+		kfree(dev->pages);	/* empty: no page left in it */
+		WRITE_ONCE(dev->pages, NULL);
+		return 0;
+	}
+	if (dev->pages)
+		return 0;
+	n = max_t(int, DIV_ROUND_UP(dev->buffersize, PAGE_SIZE), PIPE_DEF_BUFFERS);
+	pages = kcalloc(n, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	dev->npages = n;
+	dev->pr = dev->pw = 0;
+	WRITE_ONCE(dev->pages, pages);
+	return 0;
+}
+
+/* How much is buffered: the pipe is locked, both sides */
+static int scull_p_used(struct scull_pipe *dev)
+{
+	unsigned int pr;
+	int used = 0;
+
+	if (!dev->pages)
+		return dev->buffersize - 1 - spacefree(dev, scull_p_rp(dev),
+				scull_p_wp(dev));
+	for (pr = dev->pr; pr != dev->pw; pr++)
+		used += dev->pages[pr % dev->npages].len;
+	return used;
+}
+
+/*
+ * The batched control for pipes, all applied under one hold of both
+ * locks. A new buffer size resizes this pipe, as SCULL_P_IOCTSIZE
+ * does, once it has been trimmed if asked to; trimming a pipe discards
+ * the data that is buffered in it. Switching between bytes and
+ * records, in and out of broadcast mode or of page mode, needs an
+ * empty pipe, as the data would be misread otherwise. Page mode only
+ * carries bytes, to one reader at a time.
+ */
+static long scull_p_ctl(struct file *filp, struct scull_ctl __user *uctl)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	struct scull_p_file *pf;
+	struct scull_ctl ctl;
+	int trim, mode, bcast, drop, pages, writers, size, resized = 0;
+	char *buffer = NULL;	/* the new one, to resize */
+	long retval = 0;
+
+	if (copy_from_user(&ctl, uctl, sizeof(ctl)))
+		return -EFAULT;
+	trim = ctl.flags & SCULL_CTL_TRIM;
+	mode = ctl.flags & (SCULL_CTL_PACKET | SCULL_CTL_NOPACKET);
+	bcast = ctl.flags & (SCULL_CTL_BCAST | SCULL_CTL_NOBCAST);
+	drop = ctl.flags & (SCULL_CTL_DROP | SCULL_CTL_NODROP);
+	pages = ctl.flags & (SCULL_CTL_PAGES | SCULL_CTL_NOPAGES);
+	size = ctl.pipe_buffer;
+	if (ctl.quantum || ctl.qset || ctl.pipe_buffer < 0 ||
+			ctl.pipe_buffer == 1 || (ctl.flags & ~SCULL_CTL_PIPE_FLAGS))
+		return -EINVAL;	/* a pipe has no quantum, and needs 2 bytes */
+	if (mode == (SCULL_CTL_PACKET | SCULL_CTL_NOPACKET) ||
+			bcast == (SCULL_CTL_BCAST | SCULL_CTL_NOBCAST) ||
+			drop == (SCULL_CTL_DROP | SCULL_CTL_NODROP) ||
+			pages == (SCULL_CTL_PAGES | SCULL_CTL_NOPAGES))
+		return -EINVAL;
+	if (trim && !(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (size) {
+		buffer = scull_p_new_buffer(filp, size);
+		if (IS_ERR(buffer))
+			return PTR_ERR(buffer);
+	}
+
+	/*
+	 * Trimming is reading everything, so it is done as a reader;
+	 * the way the data is written, or where, only changes with
+	 * writers locked out too (writers first, as in scull_p_resize).
+	 */
+	writers = mode || bcast || drop || pages || size;
+	if (writers && mutex_lock_interruptible(&dev->wlock)) {
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	if (mutex_lock_interruptible(&dev->rlock)) {
+		if (writers)
+			mutex_unlock(&dev->wlock);
+		kvfree(buffer);
+		return -ERESTARTSYS;
+	}
+	if (trim)
+		scull_p_trim(dev);
+	if ((mode || bcast || pages) && !scull_p_empty(dev)) {
+		retval = -EBUSY;
+	} else if ((mode == SCULL_CTL_PACKET || bcast == SCULL_CTL_BCAST ||
+			pages == SCULL_CTL_PAGES) && dev->ring != &dev->hdr) {
+		retval = -EBUSY;	/* user space can't be trusted with those */
+	} else if ((mode == SCULL_CTL_PACKET || bcast == SCULL_CTL_BCAST) &&
+			(pages == SCULL_CTL_PAGES ||
+			 (dev->pages && pages != SCULL_CTL_NOPAGES))) {
+		retval = -EINVAL;
+	} else if (pages == SCULL_CTL_PAGES && ((dev->packet &&
+			mode != SCULL_CTL_NOPACKET) || (dev->bcast &&
+			bcast != SCULL_CTL_NOBCAST))) {
+		retval = -EINVAL;
+	}
+	if (size && !retval) {	/* before page mode sizes its slots */
+		retval = __scull_p_resize(dev, &buffer, size);
+		resized = !retval;
+	}
+	if (!retval) {
+		if (pages)
+			retval = scull_p_set_pages(dev, pages == SCULL_CTL_PAGES);
+		if (mode && !retval)
+			dev->packet = (mode == SCULL_CTL_PACKET);
+		if (bcast == SCULL_CTL_BCAST && !retval && !dev->bcast) {
+			/* reading bytes only moved rp: bring the cursors there */
+			list_for_each_entry(pf, &dev->readers, list)
+				WRITE_ONCE(pf->rp, dev->ring->rp);
+		}
+		if (bcast && !retval)
+			WRITE_ONCE(dev->bcast, bcast == SCULL_CTL_BCAST);
+		if (drop && !retval)
+			dev->drop = (drop == SCULL_CTL_DROP);
+	}
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.pipe_buffer = dev->buffersize;
+	ctl.size = scull_p_used(dev);
+	mutex_unlock(&dev->rlock);
+	if (writers)
+		mutex_unlock(&dev->wlock);
+
+	kvfree(buffer);	/* the old one, or the new one unused */
+	if (trim)
+		scull_p_wake_out(dev);	/* there is room now */
+	if (resized)
+		scull_p_resized(dev);
+	if (retval)
+		return retval;
+	if (copy_to_user(uctl, &ctl, sizeof(ctl)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Read many records at once. They are copied in the format they have
+ * in the ring, so this is a plain copy of the bytes they take.
+ */
+static long scull_p_read_batch(struct file *filp,
+		struct scull_p_batch __user *ubatch)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	struct scull_p_batch batch;
+	struct iovec iov;
+	struct iov_iter to;
+	char *rp, *wp, *end;
+	size_t bytes = 0;
+	int result, free, count = 0;
+	u32 len;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&batch, ubatch, sizeof(batch)))
+		return -EFAULT;
+	result = import_single_range(READ, u64_to_user_ptr(batch.buf),
+			batch.len, &iov, &to);
+	if (result)
+		return result;
+
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	result = scull_getreaddata(dev, filp);
+	if (result)
+		return result;	/* scull_getreaddata released the lock */
+	if (!dev->packet) {
+		mutex_unlock(&dev->rlock);
+		return -EINVAL;	/* a stream has no records */
+	}
+
+	rp = end = scull_p_rd_rp(dev, pf);
+	wp = scull_p_wp(dev);
+	while (end != wp) {
+		scull_p_peek(dev, end, &len, sizeof(len));
+		if (bytes + sizeof(len) + len > batch.len)
+			break;
+		bytes += sizeof(len) + len;
+		end = scull_p_advance(dev, end, sizeof(len) + len);
+		count++;
+	}
+	if (!count) {
+		mutex_unlock(&dev->rlock);
+		return -EMSGSIZE;	/* not even the first one fits */
+	}
+	if (scull_p_to_iter(dev, rp, bytes, &to) != bytes) {
+		mutex_unlock(&dev->rlock);
+		return -EFAULT;
+	}
+	scull_p_rd_set_rp(dev, pf, end);
+	free = spacefree(dev, scull_p_rp(dev), wp);
+	mutex_unlock(&dev->rlock);
+
+	scull_p_read_done(dev, free);
+	if (put_user(count, &ubatch->count))
+		return -EFAULT;
+	return bytes;
+}
+
+/*
+ * Make the buffer mappable: it moves to whole pages from vmalloc, after
+ * a page for the ring, and stays there until the pipe is released.
+ * Returns the length to map.
+ */
+static long scull_p_make_ring(struct scull_pipe *dev)
+{
+	struct scull_p_ring *ring;
+	char *buffer;
+	int size, used;
+	long retval;
+
+	if (mutex_lock_interruptible(&dev->wlock))
+		return -ERESTARTSYS;
+	if (mutex_lock_interruptible(&dev->rlock)) {
+		mutex_unlock(&dev->wlock);
+		return -ERESTARTSYS;
+	}
+	retval = -EINVAL;
+	if (dev->packet || dev->bcast || dev->pages)
+		goto out;	/* user space can't be trusted with those */
+	retval = PAGE_SIZE + dev->buffersize;
+	if (dev->ring != &dev->hdr)
+		goto out;	/* done already */
+
+	size = PAGE_ALIGN(dev->buffersize);
+	retval = -ENOMEM;
+	ring = vmalloc_user(PAGE_SIZE + size);	/* zeroed */
+	if (!ring)
+		goto out;
+	buffer = (char *)ring + PAGE_SIZE;
+	used = scull_p_straighten(dev, buffer);
+	ring->wp = used;
+	ring->size = size;
+
+	kvfree(dev->buffer);
+	dev->buffer = buffer;
+	dev->buffersize = size;
+	dev->end = buffer + size;
+	smp_store_release(&dev->ring, ring);	/* for scull_p_mmap */
+	retval = PAGE_SIZE + size;
+
+  out:
+	mutex_unlock(&dev->rlock);
+	mutex_unlock(&dev->wlock);
+	return retval;
+}
+
+/*
+ * User space moved the pointers: wake up the other side, as a read and
+ * a write from the kernel would have done.
+ */
+static void scull_p_kick(struct scull_pipe *dev)
+{
+	int free = spacefree(dev, scull_p_rp(dev), scull_p_wp(dev));
+
+	scull_p_wrote(dev, dev->buffersize - 1 - free);
+	scull_p_read_done(dev, free);
+}
+
+/*
+ * Only mappable buffers can be mapped, from their ring page on. The
+ * buffer then stays until the pipe is released, which the mapping
+ * itself prevents while it exists.
+ */
+static int scull_p_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+	struct scull_p_ring *ring = smp_load_acquire(&dev->ring);
+
+	if (ring == &dev->hdr)
+		return -ENODEV;	/* SCULL_P_IOCRING first */
+	return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+/*
+ * What a reader lost, in broadcast mode with SCULL_CTL_DROP.
+ */
+static long scull_p_dropped(struct file *filp)
+{
+	struct scull_p_file *pf = filp->private_data;
+	struct scull_pipe *dev = pf->dev;
+	long retval;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (mutex_lock_interruptible(&dev->rlock))
+		return -ERESTARTSYS;
+	retval = min(pf->dropped, (unsigned long)LONG_MAX);
+	pf->dropped = 0;
+	mutex_unlock(&dev->rlock);
+	return retval;
+}
+
+/*
+ * Set and get the wakeup thresholds.
+ */
+static long scull_p_set_wake(struct scull_pipe *dev,
+		struct scull_p_wake __user *uwake)
+{
+	struct scull_p_wake wake;
+
+	if (copy_from_user(&wake, uwake, sizeof(wake)))
+		return -EFAULT;
+	if (!wake.rlowat || !wake.wlowat)
+		return -EINVAL;
+	WRITE_ONCE(dev->rlowat, wake.rlowat);
+	WRITE_ONCE(dev->wlowat, wake.wlowat);
+	WRITE_ONCE(dev->rdelay, wake.rdelay);
+	/* sleepers may have been waiting for more than is now needed */
+	scull_p_wake_in(dev);
+	scull_p_wake_out(dev);
+	return 0;
+}
+
+static long scull_p_get_wake(struct scull_pipe *dev,
+		struct scull_p_wake __user *uwake)
+{
+	struct scull_p_wake wake;
+
+	wake.rlowat = READ_ONCE(dev->rlowat);
+	wake.wlowat = READ_ONCE(dev->wlowat);
+	wake.rdelay = READ_ONCE(dev->rdelay);
+	if (copy_to_user(uwake, &wake, sizeof(wake)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * The pipe has no quantum or qset: only its own commands are
+ * accepted.
+ */
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct scull_pipe *dev = scull_p_dev(filp);
+
+	switch(cmd) {
+	  case SCULL_P_IOCTSIZE:	/* Tell: arg is the new size */
+		return scull_p_resize(filp, arg);
+
+	  case SCULL_P_IOCQSIZE:	/* Query: return it */
+		return READ_ONCE(dev->buffersize);
+
+	  case SCULL_P_IOCSWAKE:
+		return scull_p_set_wake(dev, (struct scull_p_wake __user *)arg);
+
+	  case SCULL_P_IOCGWAKE:
+		return scull_p_get_wake(dev, (struct scull_p_wake __user *)arg);
+
+	  case SCULL_P_IOCRBATCH:
+		return scull_p_read_batch(filp, (struct scull_p_batch __user *)arg);
+
+	  case SCULL_P_IOCRING:
+		return scull_p_make_ring(dev);
+
+	  case SCULL_P_IOCKICK:
+		scull_p_kick(dev);
+		return 0;
+
+	  case SCULL_P_IOCQDROPPED:	/* Query: return it, and start again */
+		return scull_p_dropped(filp);
+
+	  case SCULL_IOCCTL:
+		return scull_p_ctl(filp, (struct scull_ctl __user *)arg);
+
+	  default:
+		return -ENOTTY;
+	}
+}
+
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-	struct scull_pipe *dev = filp->private_data;
+	struct scull_pipe *dev = scull_p_dev(filp);
 
 	return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
@@ -287,8 +1511,18 @@ static int scull_p_seq_show(struct seq_file *s, void *v)
 	seq_printf(s, "Default buffersize is %i, scull_p_devices = %p\n", scull_p_buffer, scull_p_devices);
 	seq_printf(s, "\nDevice %i: %p\n", (int)(p - scull_p_devices), p);
 	seq_printf(s, "   Buffer: %p to %p (%i bytes)\n", p->buffer, p->end, p->buffersize);
-	seq_printf(s, "   rp %p   wp %p		wp-rp= %li\n", p->rp, p->wp, p->wp - p->rp);
+	if (p->ring)
+		seq_printf(s, "   rp %u   wp %u   %s\n", p->ring->rp, p->ring->wp,
+				p->ring == &p->hdr ? "" : "mappable");
 	seq_printf(s, "   readers %i   writers %i\n", p->nreaders, p->nwriters);
+	seq_printf(s, "   rlowat %u   wlowat %u   rdelay %uus\n", p->rlowat,
+			p->wlowat, p->rdelay);
+	seq_printf(s, "   %s%s%s%s\n", p->packet ? "packets" : "bytes",
+			p->bcast ? ", broadcast" : "", p->drop ? ", drop" : "",
+			p->pages ? ", pages" : "");
+	if (p->pages)
+		seq_printf(s, "   slots %u   pr %u   pw %u\n", p->npages, p->pr,
+				p->pw);
 
 	up(&p->sem);
 	return 0;
@@ -351,10 +1585,14 @@ void scull_p_remove_proc(void)
 struct file_operations scull_pipe_fops = {
 	.owner = 	THIS_MODULE,
 	.llseek =	no_llseek,
-	.read =		scull_p_read,
-	.write = 	scull_p_write,
+	.read_iter =	scull_p_read_iter,
+	.write_iter = 	scull_p_write_iter,
+	.splice_read =	scull_p_splice_read,
+	.splice_write =	scull_p_splice_write,
 	.poll = 	scull_p_poll,
-	.compat_ioctl =	scull_ioctl,
+	.mmap =		scull_p_mmap,
+	.unlocked_ioctl = scull_p_ioctl,
+	.compat_ioctl =	scull_p_ioctl,
 	.open = 	scull_p_open,
 	.release = 	scull_p_release,
 	.fasync = 	scull_p_fasync,
@@ -399,6 +1637,10 @@ int scull_p_init(dev_t firstdev)
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		init_waitqueue_head(&(scull_p_devices[i].inq));		
 		init_waitqueue_head(&(scull_p_devices[i].outq));		
+		timer_setup(&scull_p_devices[i].rtimer, scull_p_rtimer_fn, 0);
+		INIT_LIST_HEAD(&scull_p_devices[i].readers);
+		mutex_init(&scull_p_devices[i].rlock);
+		mutex_init(&scull_p_devices[i].wlock);
 		sema_init(&scull_p_devices[i].sem, 1);
 		scull_p_setup_cdev(scull_p_devices + i, i);
 	}
@@ -428,7 +1670,8 @@ void scull_p_cleanup(void)
 
 	for (i = 0; i < scull_p_nr_devs; i++) {
 		cdev_del(&scull_p_devices[i].cdev);
-		kfree(scull_p_devices[i].buffer);
+		del_timer_sync(&scull_p_devices[i].rtimer);
+		scull_p_free_buffer(scull_p_devices + i);
 	}
 	kfree(scull_p_devices);	
 	unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
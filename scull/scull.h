@@ -6,6 +6,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h>  /* needed for the _IOW etc stuff used later */
+#include <linux/types.h>  /* __u64 and friends, for the ioctl structures */
 
 /*
  * Macros to help debugging
@@ -39,14 +40,26 @@
 #define SCULL_P_NR_DEVS 4	/* scullpipe0 through scullpipe3 */
 #endif
 
+#ifndef SCULL_SNAP_NR_DEVS
+#define SCULL_SNAP_NR_DEVS 4	/* scullsnap0 through scullsnap3 */
+#endif
+
 /*
  * The bare device is a variable-length region of memory,
- * Use a linked list of indirect blocks.
+ * Use a radix tree of indirect blocks.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
+ * "scull_dev->data" is indexed by quantum-set number; each entry is
+ * an array of pointers, each pointer refers to a struct scull_quantum
+ * holding a memory area of SCULL_QUANTUM bytes. Missing entries are
+ * holes. A quantum can be shared, copy-on-write, by several sets.
  *
  * The array (quantum-set) is SCULL_QSET long.
+ *
+ * Those are the defaults: each device can be given its own quantum and
+ * qset by ioctl(), which lays its data out again in the new geometry.
+ *
+ * A device whose quantum is exactly PAGE_SIZE can be mmap()ed: its
+ * quanta are whole pages from the page allocator.
  */
 
 #ifndef SCULL_QUANTUM
@@ -57,6 +70,14 @@
 #define SCULL_QSET 1000
 #endif
 
+/*
+ * Trimming a device keeps up to this many quanta (and as many quantum
+ * sets) aside for reuse, instead of freeing them.
+ */
+#ifndef SCULL_POOL_MAX
+#define SCULL_POOL_MAX 1024
+#endif
+
 /*
  * The pipe device is a simple circular buffer. Here its default size
  */
@@ -65,20 +86,80 @@
 #endif
 
 /*
- * Representation of scull quantum sets.
+ * and how far users can grow it with SCULL_P_IOCTSIZE, unless they
+ * have CAP_SYS_RESOURCE (like /proc/sys/fs/pipe-max-size)
+ */
+#ifndef SCULL_P_MAX_BUFFER
+#define SCULL_P_MAX_BUFFER (1024 * 1024)
+#endif
+
+/*
+ * A pool of recycled objects, all of the same size.
+ */
+struct scull_pool {
+	void *head;			/* free objects, linked through word 0 */
+	int count;			/* how many are there */
+	int size;			/* and how big they are */
+	unsigned long hits, misses;	/* allocations served, or not */
+};
+
+/*
+ * A quantum, and the number of quantum sets pointing to it; sets of
+ * different devices can share it after a clone. Whoever drops the
+ * last reference frees it, and whoever writes to a shared quantum
+ * copies it first.
+ */
+struct scull_quantum {
+	void *data;			/* the quantum itself, or compressed */
+	atomic_t count;			/* references from quantum sets */
+	unsigned long atime;		/* jiffies, when last read or written */
+	int clen;			/* compressed size if cold, else 0 */
+	int hashed;			/* size, if in the dedup table */
+	u64 hash;			/* of the contents, then */
+	struct hlist_node hnode;	/* dedup.c */
+};
+
+/*
+ * I/O statistics, kept per CPU and summed when read (stats.c).
  */
-struct scull_qset {
-	void **data;
-	struct scull_qset *next;
+struct scull_stats {
+	u64 reads, read_bytes;		/* read calls, and bytes returned */
+	u64 writes, write_bytes;	/* write calls, and bytes accepted */
+	u64 quanta;			/* quanta allocated */
+	u64 trims;			/* times the device was emptied */
+	u64 lock_wait;			/* ns spent waiting for the semaphore */
+	u64 restarts;			/* calls given up with -ERESTARTSYS */
+	u64 shared;			/* quanta shared by a clone */
+	u64 cow;			/* shared quanta copied on write */
+	u64 dedup_hits;			/* written quanta found in the table */
+	u64 dedup_misses;		/* and entered in it */
 };
 
+#define scull_stat_add(dev, field, n) do {				\
+		if ((dev)->stats)					\
+			this_cpu_add((dev)->stats->field, (n));		\
+	} while (0)
+#define scull_stat_inc(dev, field)	scull_stat_add(dev, field, 1)
+
 struct scull_dev {
-	struct scull_qset *data;	/* Pointer to first quantum set */
+	struct radix_tree_root *data;	/* quantum sets, by set number */
 	int quantum;			/* the current quantum size */
 	int qset;			/* the current array size */
 	unsigned long size;		/* amount of data stored here */
 	unsigned int access_key;	/* used by sculluid and scullpriv */
-	struct semaphore sem;		/* mutual exclusion semaphore */
+	atomic_t vmas;			/* active mappings */
+	unsigned long nquanta;		/* quanta allocated */
+	unsigned long ncold;		/* of which compressed */
+	unsigned long cbytes;		/* and their compressed size */
+	unsigned long limit;		/* bytes of quanta allowed, 0 for any */
+	int cache;			/* data may be dropped under pressure */
+	int dedup;			/* share identical quanta */
+	struct list_head list;		/* all the devices, for the shrinker */
+	struct scull_stats __percpu *stats;	/* I/O statistics */
+	struct dentry *debugfs;		/* where they are shown */
+	struct scull_pool qpool;	/* recycled quanta */
+	struct scull_pool spool;	/* recycled quantum sets */
+	struct rw_semaphore sem;	/* readers share, writers exclude */
  	struct cdev cdev;		/* Char device structure */
 };
 
@@ -95,6 +176,12 @@ extern int scull_major;		/* main.c */
 extern int scull_nr_devs;
 extern int scull_quantum;
 extern int scull_qset;
+extern int scull_span;
+extern int scull_pool_max;
+extern unsigned long scull_mem_limit;
+extern unsigned long scull_dev_limit;
+extern atomic_long_t scull_mem_used;
+extern int scull_cold_secs;	/* compress.c */
 
 extern int scull_p_buffer;	/* pipe.c */
 
@@ -112,14 +199,58 @@ void	scull_p_remove_proc(void);
 int	scull_access_init(dev_t dev);
 void	scull_access_cleanup(void);
 
+int	scull_snap_init(dev_t dev);
+void	scull_snap_cleanup(void);
+int	scull_snap_create(struct scull_dev *dev);
+
 int	scull_trim(struct scull_dev *dev);
+void	scull_drain_pools(struct scull_dev *dev);
+unsigned long scull_shrink(struct scull_dev *dev, unsigned long nr);
+void	scull_tier(struct scull_dev *dev, unsigned long idle);
+struct scull_quantum **scull_follow(struct scull_dev *dev, unsigned long n);
 
-ssize_t	scull_read(struct file *filp, char __user *buf, size_t count,
-		   loff_t *f_pos);
-ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
-		   loff_t *f_pos);
+ssize_t	scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t	scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t	scull_llseek(struct file *filp, loff_t off, int whence);
+long	scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
 long	scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+ssize_t	scull_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags);
+int	scull_clone_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, u64 len);
+int	scull_snapshot(struct scull_dev *src, struct scull_dev *snap);
+
+int	scull_mmap(struct file *filp, struct vm_area_struct *vma);	/* mmap.c */
+ssize_t	scull_splice_read(struct file *in, loff_t *ppos,		/* splice.c */
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags);
+
+void	scull_down_read(struct scull_dev *dev);				/* stats.c */
+int	scull_down_write(struct scull_dev *dev);
+int	scull_stats_register(struct scull_dev *dev, const char *name);
+void	scull_stats_unregister(struct scull_dev *dev);
+void	scull_stats_init(void);
+void	scull_stats_cleanup(void);
+
+void	scull_mem_register(struct scull_dev *dev);			/* shrink.c */
+void	scull_mem_unregister(struct scull_dev *dev);
+unsigned long scull_reclaimable(struct scull_dev *dev);
+void	scull_for_each_dev(void (*fn)(struct scull_dev *dev, void *arg),
+		void *arg);
+int	scull_shrink_init(void);
+void	scull_shrink_cleanup(void);
+
+int	scull_compress(const void *src, unsigned int slen, void *dst,	/* compress.c */
+		unsigned int *dlen);
+int	scull_decompress(const void *src, unsigned int slen, void *dst,
+		unsigned int dlen);
+void	scull_compress_init(void);
+void	scull_compress_cleanup(void);
+
+struct scull_quantum *scull_dedup_insert(struct scull_quantum *q, int size);	/* dedup.c */
+int	scull_dedup_claim(struct scull_quantum *q);
+void	scull_dedup_forget(struct scull_quantum *q);
+extern atomic_long_t scull_dedup_entries;
 
 /*
  * Ioctl definitions
@@ -156,12 +287,148 @@ long	scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
  * The other entities only have "Tell" and "Query", because they're
  * not printed in the book, and there's no need to have all size,
  * (The previous stuff was only there to show different ways to do it.
+ * For scullpipe, they resize the buffer of that very pipe, keeping
+ * the data in it, much like F_SETPIPE_SZ and F_GETPIPE_SZ. Only an
+ * opening for writing may resize it.
  */
 #define SCULL_P_IOCTSIZE	_IO(SCULL_IOC_MAGIC, 13)
 #define SCULL_P_IOCQSIZE	_IO(SCULL_IOC_MAGIC, 14)
+
+/*
+ * Punch a hole in the bare device, like fallocate(PUNCH_HOLE) does
+ * for regular files: quanta in the range are released.
+ */
+struct scull_range {
+	__u64 offset;
+	__u64 length;
+};
+
+#define SCULL_IOCPUNCH		_IOW(SCULL_IOC_MAGIC, 15, struct scull_range)
+
+/*
+ * Batched control, for both the bare and the pipe devices: the new
+ * settings go in (zero keeps the current value, and each device only
+ * accepts the fields that apply to it), the current settings and
+ * statistics come back out in one round-trip.
+ */
+struct scull_ctl {
+	__s32 quantum;		/* in/out: bare device */
+	__s32 qset;		/* in/out: bare device */
+	__s32 pipe_buffer;	/* in/out: pipe device */
+	__u32 flags;		/* in: SCULL_CTL_* */
+	__u64 size;		/* out: bytes stored, or buffered in a pipe */
+	__u64 quanta;		/* out: quanta allocated */
+	__u64 pool_hits;	/* out: quanta recycled from the pool */
+	__u64 pool_misses;	/* out: quanta from the allocator */
+};
+
+#define SCULL_CTL_TRIM		0x0001	/* drop all data, before the rest */
+#define SCULL_CTL_CACHE		0x0002	/* bare: data may be reclaimed */
+#define SCULL_CTL_NOCACHE	0x0004	/* bare: data is kept (default) */
+#define SCULL_CTL_DEDUP		0x0008	/* bare: share identical quanta */
+#define SCULL_CTL_NODEDUP	0x0010	/* bare: don't (default) */
+#define SCULL_CTL_FLAGS		0x001f	/* all the valid flags, bare */
+#define SCULL_CTL_PACKET	0x0020	/* pipe: one record per write */
+#define SCULL_CTL_NOPACKET	0x0040	/* pipe: a byte stream (default) */
+#define SCULL_CTL_BCAST		0x0080	/* pipe: each reader reads all */
+#define SCULL_CTL_NOBCAST	0x0100	/* pipe: readers share (default) */
+#define SCULL_CTL_DROP		0x0200	/* pipe: slow readers lose data */
+#define SCULL_CTL_NODROP	0x0400	/* pipe: writers wait (default) */
+#define SCULL_CTL_PAGES		0x0800	/* pipe: data in pages, spliced whole */
+#define SCULL_CTL_NOPAGES	0x1000	/* pipe: data in the buffer (default) */
+#define SCULL_CTL_PIPE_FLAGS	0x1fe1	/* all the valid flags, pipe */
+
+#define SCULL_IOCCTL		_IOWR(SCULL_IOC_MAGIC, 16, struct scull_ctl)
+
+/*
+ * The per-device memory cap, in bytes of quanta; 0 means no cap
+ * other than the global one (scull_mem_limit). Writes that would
+ * need a quantum beyond either cap fail with ENOSPC.
+ */
+#define SCULL_IOCSLIMIT		_IOW(SCULL_IOC_MAGIC, 17, __u64)
+#define SCULL_IOCGLIMIT		_IOR(SCULL_IOC_MAGIC, 18, __u64)
+
+/*
+ * Clone a range of another bare device (or of this one) into this one,
+ * like copy_file_range(); a length of 0 means up to the end of the
+ * source. Whole quanta are shared copy-on-write, the rest is copied.
+ * Returns the number of bytes cloned.
+ */
+struct scull_clone {
+	__s64 src_fd;		/* open for reading */
+	__u64 src_offset;
+	__u64 length;
+	__u64 dest_offset;
+};
+
+#define SCULL_IOCCLONE		_IOW(SCULL_IOC_MAGIC, 19, struct scull_clone)
+
+/*
+ * SNAP freezes the device into a free scullsnap device, and returns
+ * its number; SNAPDROP, on the scullsnap device, releases it. Both
+ * need CAP_SYS_ADMIN.
+ */
+#define SCULL_IOCSNAP		_IO(SCULL_IOC_MAGIC, 20)
+#define SCULL_IOCSNAPDROP	_IO(SCULL_IOC_MAGIC, 21)
+
+/*
+ * Wakeup thresholds of a pipe: readers are woken once "rlowat" bytes
+ * are buffered, or "rdelay" microseconds (at least a tick) after a
+ * write that left fewer; writers are woken once "wlowat" bytes are
+ * free. The defaults, 1, 1 and 0, wake the other side every time.
+ */
+struct scull_p_wake {
+	__u32 rlowat;
+	__u32 wlowat;
+	__u32 rdelay;
+};
+
+#define SCULL_P_IOCSWAKE	_IOW(SCULL_IOC_MAGIC, 22, struct scull_p_wake)
+#define SCULL_P_IOCGWAKE	_IOR(SCULL_IOC_MAGIC, 23, struct scull_p_wake)
+
+/*
+ * Batch read of a pipe in packet mode: as many whole records as fit
+ * in "len" bytes at "buf", each one as its length (a native __u32,
+ * not aligned) followed by its data. Returns the bytes read, and the
+ * number of records in "count".
+ */
+struct scull_p_batch {
+	__u64 buf;
+	__u32 len;
+	__u32 count;		/* out */
+};
+
+#define SCULL_P_IOCRBATCH	_IOWR(SCULL_IOC_MAGIC, 24, struct scull_p_batch)
+
+/*
+ * A pipe can be mapped, to move data without system calls. RING makes
+ * its buffer mappable (its size is rounded up to whole pages, and from
+ * then on it can't be resized or switched to packets), and returns the
+ * length to map: a page holding this header, then the data. Each side
+ * moves its own offset, with release semantics once it is done with
+ * the data, and reads the other one with acquire semantics; the pipe
+ * is empty when they are equal, and full when "wp" is right behind
+ * "rp". After moving an offset from user space, KICK wakes whoever
+ * sleeps in read, write or poll on the other side.
+ */
+struct scull_p_ring {
+	__u32 rp;		/* where to read, moved by the reader */
+	__u32 size;		/* of the data */
+	__u8 pad[56];		/* so that the two sides don't share a line */
+	__u32 wp;		/* where to write, moved by the writer */
+};
+
+#define SCULL_P_IOCRING		_IO(SCULL_IOC_MAGIC, 25)
+#define SCULL_P_IOCKICK		_IO(SCULL_IOC_MAGIC, 26)
+
+/*
+ * In broadcast mode, with SCULL_CTL_DROP, how many bytes this reader
+ * lost for being too slow, since the last time it asked.
+ */
+#define SCULL_P_IOCQDROPPED	_IO(SCULL_IOC_MAGIC, 27)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 27
 
 #endif /* _SCULL_H_ */
  
@@ -0,0 +1,140 @@
+/*
+ * shrink.c -- memory pressure and the bare scull devices
+ *
+ * All the bare devices are kept in a list, so that the shrinker can
+ * walk them when the system runs short of memory. It gives back the
+ * quanta recycled in the device pools and, from the devices that were
+ * marked as caches (SCULL_CTL_CACHE), the data itself.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/shrinker.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * The list of devices, and a mutex to protect it. The compression
+ * worker allocates memory with the mutex held, so the shrinker only
+ * ever tries to take it.
+ */
+static LIST_HEAD(scull_dev_list);
+static DEFINE_MUTEX(scull_dev_lock);
+static int scull_shrinker_registered;
+
+void scull_mem_register(struct scull_dev *dev)
+{
+	dev->limit = scull_dev_limit;
+	mutex_lock(&scull_dev_lock);
+	list_add_tail(&dev->list, &scull_dev_list);
+	mutex_unlock(&scull_dev_lock);
+}
+
+void scull_mem_unregister(struct scull_dev *dev)
+{
+	if (!dev->list.next)	/* never made it to the list */
+		return;
+	mutex_lock(&scull_dev_lock);
+	list_del_init(&dev->list);
+	mutex_unlock(&scull_dev_lock);
+}
+
+/*
+ * Call "fn" for each device, with the list locked; "fn" may sleep.
+ */
+void scull_for_each_dev(void (*fn)(struct scull_dev *dev, void *arg), void *arg)
+{
+	struct scull_dev *dev;
+
+	mutex_lock(&scull_dev_lock);
+	list_for_each_entry(dev, &scull_dev_list, list)
+		fn(dev, arg);
+	mutex_unlock(&scull_dev_lock);
+}
+
+/*
+ * How many objects the shrinker could take from a device right now.
+ * This is only an estimate, so the semaphore is not needed.
+ */
+unsigned long scull_reclaimable(struct scull_dev *dev)
+{
+	unsigned long count = READ_ONCE(dev->qpool.count) +
+			READ_ONCE(dev->spool.count);
+
+	if (READ_ONCE(dev->cache))
+		count += READ_ONCE(dev->nquanta);
+	return count;
+}
+
+static unsigned long scull_shrink_count(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct scull_dev *dev;
+	unsigned long count = 0;
+
+	if (!mutex_trylock(&scull_dev_lock))
+		return 0;
+	list_for_each_entry(dev, &scull_dev_list, list)
+		count += scull_reclaimable(dev);
+	mutex_unlock(&scull_dev_lock);
+	return count;
+}
+
+/*
+ * Never wait for a device here: its writer may well be the one who
+ * is allocating memory. Busy devices are simply skipped, and each
+ * device we went through goes to the back of the list, so the next
+ * scan starts with someone else.
+ */
+static unsigned long scull_shrink_scan(struct shrinker *shrink,
+		struct shrink_control *sc)
+{
+	struct scull_dev *dev, *next;
+	unsigned long freed = 0, nr = sc->nr_to_scan;
+	LIST_HEAD(done);
+
+	if (!mutex_trylock(&scull_dev_lock))
+		return SHRINK_STOP;
+	list_for_each_entry_safe(dev, next, &scull_dev_list, list) {
+		if (freed >= nr)
+			break;
+		if (!down_write_trylock(&dev->sem))
+			continue;
+		freed += scull_shrink(dev, nr - freed);
+		up_write(&dev->sem);
+		list_move_tail(&dev->list, &done);
+	}
+	list_splice_tail(&done, &scull_dev_list);
+	mutex_unlock(&scull_dev_lock);
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker scull_shrinker = {
+	.count_objects = scull_shrink_count,
+	.scan_objects = scull_shrink_scan,
+	.seeks = DEFAULT_SEEKS,
+};
+
+int scull_shrink_init(void)
+{
+	int result = register_shrinker(&scull_shrinker);
+
+	if (result == 0)
+		scull_shrinker_registered = 1;
+	return result;
+}
+
+void scull_shrink_cleanup(void)
+{
+	if (scull_shrinker_registered)
+		unregister_shrinker(&scull_shrinker);
+	scull_shrinker_registered = 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * snap.c -- read-only snapshots of the bare scull devices
+ *
+ * SCULL_IOCSNAP freezes the contents of a device into one of the
+ * scullsnap devices, by sharing all of its quanta; the device itself
+ * copies a quantum the first time it writes to it afterwards. So a
+ * backup can read the snapshot at leisure, and it holds no lock of
+ * the device while doing so.
+ *
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/slab.h>		/* kmalloc() */
+#include <linux/fs.h>		/* everything... */
+#include <linux/errno.h>	/* error codes */
+#include <linux/cdev.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/splice.h>
+
+#include "scull.h"		/* local definitions */
+
+struct scull_snap {
+	struct scull_dev dev;		/* the frozen data */
+	int used;			/* holds a snapshot */
+};
+
+int scull_snap_nr_devs = SCULL_SNAP_NR_DEVS;	/* number of snapshot devices */
+module_param(scull_snap_nr_devs, int, S_IRUGO);
+
+static struct scull_snap *scull_snap_devices;
+static dev_t scull_snap_devno;		/* Our first device number */
+static DEFINE_MUTEX(scull_snap_lock);	/* protects the "used" flags */
+
+/*
+ * Take a snapshot of "dev" into the first free snapshot device, and
+ * return its number.
+ */
+int scull_snap_create(struct scull_dev *dev)
+{
+	int i, retval = -ENOSPC;	/* all of them are taken */
+
+	if (!scull_snap_devices)
+		return -ENODEV;
+	if (mutex_lock_interruptible(&scull_snap_lock))
+		return -ERESTARTSYS;
+	for (i = 0; i < scull_snap_nr_devs; i++) {
+		if (scull_snap_devices[i].used)
+			continue;
+		retval = scull_snapshot(dev, &scull_snap_devices[i].dev);
+		if (retval == 0) {
+			scull_snap_devices[i].used = 1;
+			retval = i;
+		}
+		break;
+	}
+	mutex_unlock(&scull_snap_lock);
+	return retval;
+}
+
+/*
+ * Let go of a snapshot, so that its device can be used again.
+ */
+static int scull_snap_drop(struct scull_snap *snap)
+{
+	int retval;
+
+	if (mutex_lock_interruptible(&scull_snap_lock))
+		return -ERESTARTSYS;
+	retval = scull_down_write(&snap->dev);
+	if (retval == 0) {
+		retval = scull_trim(&snap->dev);	/* fails if mapped */
+		if (retval == 0) {
+			scull_drain_pools(&snap->dev);
+			snap->used = 0;
+		}
+		up_write(&snap->dev.sem);
+	}
+	mutex_unlock(&scull_snap_lock);
+	return retval;
+}
+
+/*
+ * Open and ioctl. Everything else is the bare device read path.
+ */
+static int scull_snap_open(struct inode *inode, struct file *filp)
+{
+	if (filp->f_mode & FMODE_WRITE)
+		return -EROFS;
+	filp->private_data = container_of(inode->i_cdev, struct scull_dev, cdev);
+	return 0;
+}
+
+static int scull_snap_release(struct inode *inode, struct file *filp)
+{
+	return 0;
+}
+
+/*
+ * Only the commands that don't change the data go through to the
+ * scull ioctl method.
+ */
+static long scull_snap_ioctl(struct file *filp, unsigned int cmd,
+		unsigned long arg)
+{
+	struct scull_dev *dev = filp->private_data;
+
+	switch(cmd) {
+	  case SCULL_IOCSNAPDROP:	/* not for any reader to decide */
+		if (! capable(CAP_SYS_ADMIN))
+			return -EPERM;
+		return scull_snap_drop(container_of(dev, struct scull_snap, dev));
+
+	  case SCULL_IOCGQUANTUM:
+	  case SCULL_IOCQQUANTUM:
+	  case SCULL_IOCGQSET:
+	  case SCULL_IOCQQSET:
+	  case SCULL_IOCGLIMIT:
+		return scull_ioctl(filp, cmd, arg);
+
+	  default:
+		return -ENOTTY;
+	}
+}
+
+struct file_operations scull_snap_fops = {
+	.owner =	THIS_MODULE,
+	.llseek =	scull_llseek,
+	.read_iter =	scull_read_iter,
+	.mmap =		scull_mmap,
+	.splice_read =	scull_splice_read,
+	.unlocked_ioctl = scull_snap_ioctl,
+	.compat_ioctl =	scull_snap_ioctl,
+	.open =		scull_snap_open,
+	.release =	scull_snap_release,
+};
+
+/*
+ * Set up a cdev entry.
+ */
+static void scull_snap_setup_cdev(struct scull_snap *snap, int index)
+{
+	struct scull_dev *dev = &snap->dev;
+	int err, devno = scull_snap_devno + index;
+	char name[16];
+
+	dev->quantum = scull_quantum;
+	dev->qset = scull_qset;
+	init_rwsem(&dev->sem);
+	scull_mem_register(dev);
+	dev->limit = 0;		/* snapshots only share memory */
+
+	cdev_init(&dev->cdev, &scull_snap_fops);
+	dev->cdev.owner = THIS_MODULE;
+	snprintf(name, sizeof(name), "scullsnap%d", index);
+	if (scull_stats_register(dev, name))	/* the device works without */
+		printk(KERN_NOTICE "scull: no statistics for %s\n", name);
+	err = cdev_add(&dev->cdev, devno, 1);
+	/* Fail gracefully if need be */
+	if (err)
+		printk(KERN_NOTICE "Error %d adding scullsnap%d\n", err, index);
+}
+
+/*
+ * Initialize the snapshot devs; return how many we did.
+ */
+int scull_snap_init(dev_t firstdev)
+{
+	int i, result;
+
+	PDEBUG("scull_snap_init() is called, firstdev = %i\n", firstdev);
+
+	result = register_chrdev_region(firstdev, scull_snap_nr_devs, "sculls");
+	if (result < 0) {
+		printk(KERN_NOTICE "Unable to get sculls region, error %d\n", result);
+		return 0;
+	}
+	scull_snap_devno = firstdev;
+	scull_snap_devices = kmalloc(scull_snap_nr_devs * sizeof(struct scull_snap),
+			GFP_KERNEL);
+	if (scull_snap_devices == NULL) {
+		unregister_chrdev_region(firstdev, scull_snap_nr_devs);
+		return 0;
+	}
+	memset(scull_snap_devices, 0, scull_snap_nr_devs * sizeof(struct scull_snap));
+	for (i = 0; i < scull_snap_nr_devs; i++)
+		scull_snap_setup_cdev(scull_snap_devices + i, i);
+	return scull_snap_nr_devs;
+}
+
+/*
+ * This is called by cleanup_module or on failure.
+ * It is required to never fail, even if nothing was initialized first
+ */
+void scull_snap_cleanup(void)
+{
+	int i;
+
+	PDEBUG("scull_snap_cleanup() is called\n");
+
+	if (!scull_snap_devices)
+		return;	/* nothing else to release */
+
+	for (i = 0; i < scull_snap_nr_devs; i++) {
+		struct scull_dev *dev = &scull_snap_devices[i].dev;
+
+		cdev_del(&dev->cdev);
+		scull_trim(dev);
+		scull_drain_pools(dev);
+		scull_stats_unregister(dev);
+		scull_mem_unregister(dev);
+	}
+	kfree(scull_snap_devices);
+	scull_snap_devices = NULL;
+	unregister_chrdev_region(scull_snap_devno, scull_snap_nr_devs);
+}
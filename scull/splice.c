@@ -0,0 +1,105 @@
+/*
+ * splice.c -- splice and sendfile for the bare scull device
+ *
+ * Quanta of exactly one page are handed to the pipe as they are, with
+ * a page reference and no copy, much like the page cache does for a
+ * regular file. Anything else goes through read_iter, which copies
+ * the data into pages of the pipe.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* min() */
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+
+#include "scull.h"		/* local definitions */
+
+/*
+ * Pages still in the descriptor when splice_to_pipe gives up (the pipe
+ * was full, or its reader went away) just lose our reference.
+ */
+static void scull_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/*
+ * Gather the page quanta covering the data at *ppos. We stop at the
+ * first hole, so a hole is only ever seen at the start of a request;
+ * it is left to the copying path, which fills it with zeroes. A
+ * quantum that is later released by the device is only really freed
+ * when the pipe lets go of it too (see scull_put_quantum). Its
+ * contents, though, are not frozen: like a page cache page, it shows
+ * writes to the device that happen before the pipe is read.
+ *
+ * The pages can't be stolen, as they still belong to the device.
+ */
+ssize_t scull_splice_read(struct file *in, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t len, unsigned int flags)
+{
+	struct scull_dev *dev = in->private_data;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &nosteal_pipe_buf_ops,
+		.spd_release = scull_spd_release,
+	};
+	unsigned long pos = *ppos, item;
+	struct scull_quantum **dptr;
+	int s_pos, q_pos;
+	size_t chunk;
+	ssize_t retval;
+
+	scull_down_read(dev);
+	if (dev->quantum != PAGE_SIZE) {
+		up_read(&dev->sem);
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+	}
+	if (pos >= dev->size) {
+		up_read(&dev->sem);
+		return 0;
+	}
+
+	while (len > 0 && pos < dev->size && spd.nr_pages < PIPE_DEF_BUFFERS) {
+		item = pos / (PAGE_SIZE * dev->qset);
+		s_pos = (pos >> PAGE_SHIFT) % dev->qset;
+		q_pos = pos & ~PAGE_MASK;
+
+		dptr = scull_follow(dev, item);
+		if (!dptr || !dptr[s_pos] || dptr[s_pos]->clen)
+			break;	/* a hole, or compressed */
+		chunk = min(len, PAGE_SIZE - q_pos);
+		chunk = min(chunk, (size_t)(dev->size - pos));
+
+		pages[spd.nr_pages] = virt_to_page(dptr[s_pos]->data);
+		get_page(pages[spd.nr_pages]);
+		partial[spd.nr_pages].offset = q_pos;
+		partial[spd.nr_pages].len = chunk;
+		spd.nr_pages++;
+		pos += chunk;
+		len -= chunk;
+	}
+	up_read(&dev->sem);
+
+	if (!spd.nr_pages)	/* a hole: let read_iter fill in the zeroes */
+		return generic_file_splice_read(in, ppos, pipe, len, flags);
+
+	/* the references we hold keep the pages alive without the lock */
+	retval = splice_to_pipe(pipe, &spd);
+	if (retval > 0) {
+		*ppos += retval;
+		scull_stat_inc(dev, reads);
+		scull_stat_add(dev, read_bytes, retval);
+	}
+	return retval;
+}
@@ -0,0 +1,167 @@
+/*
+ * stats.c -- per-CPU I/O statistics for the bare scull devices
+ *
+ * Each device counts its activity in per-CPU counters, so that the
+ * hot paths never share a cache line for accounting; the counters are
+ * summed when read, from /sys/kernel/debug/scull/<device>.
+ *
+ */
+
+#include <linux/module.h>
+
+#include <linux/kernel.h>	/* printk() */
+#include <linux/fs.h>
+#include <linux/errno.h>	/* error codes */
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/ktime.h>
+
+#include "scull.h"		/* local definitions */
+
+static struct dentry *scull_debugfs;	/* our directory */
+
+/*
+ * Take the device semaphore, accounting for the time spent waiting.
+ * Writers can be interrupted: they get -ERESTARTSYS, and so do their
+ * callers.
+ */
+void scull_down_read(struct scull_dev *dev)
+{
+	u64 start = ktime_get_ns();
+
+	down_read(&dev->sem);
+	scull_stat_add(dev, lock_wait, ktime_get_ns() - start);
+}
+
+int scull_down_write(struct scull_dev *dev)
+{
+	u64 start = ktime_get_ns();
+
+	if (down_write_killable(&dev->sem)) {
+		scull_stat_inc(dev, restarts);
+		return -ERESTARTSYS;
+	}
+	scull_stat_add(dev, lock_wait, ktime_get_ns() - start);
+	return 0;
+}
+
+/*
+ * The debugfs file: sum up all the CPUs. Nothing here takes the
+ * device semaphore, so the plain fields are only a snapshot.
+ */
+static int scull_stats_show(struct seq_file *s, void *v)
+{
+	struct scull_dev *dev = s->private;
+	struct scull_stats sum, *st;
+	unsigned long cold, cbytes, ratio;
+	int cpu;
+
+	memset(&sum, 0, sizeof(sum));
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(dev->stats, cpu);
+		sum.reads += st->reads;
+		sum.read_bytes += st->read_bytes;
+		sum.writes += st->writes;
+		sum.write_bytes += st->write_bytes;
+		sum.quanta += st->quanta;
+		sum.trims += st->trims;
+		sum.lock_wait += st->lock_wait;
+		sum.restarts += st->restarts;
+		sum.shared += st->shared;
+		sum.cow += st->cow;
+		sum.dedup_hits += st->dedup_hits;
+		sum.dedup_misses += st->dedup_misses;
+	}
+
+	seq_printf(s, "quantum: %i\nqset: %i\n", READ_ONCE(dev->quantum),
+			READ_ONCE(dev->qset));
+	seq_printf(s, "size: %lu\nquanta: %lu\n", READ_ONCE(dev->size),
+			READ_ONCE(dev->nquanta));
+	seq_printf(s, "reads: %llu\nread_bytes: %llu\n", sum.reads,
+			sum.read_bytes);
+	seq_printf(s, "writes: %llu\nwrite_bytes: %llu\n", sum.writes,
+			sum.write_bytes);
+	seq_printf(s, "quanta_allocated: %llu\ntrims: %llu\n", sum.quanta,
+			sum.trims);
+	seq_printf(s, "lock_wait_ns: %llu\nrestarts: %llu\n", sum.lock_wait,
+			sum.restarts);
+	seq_printf(s, "quanta_shared: %llu\nquanta_copied: %llu\n", sum.shared,
+			sum.cow);
+	seq_printf(s, "dedup: %i\ndedup_hits: %llu\ndedup_misses: %llu\n",
+			READ_ONCE(dev->dedup), sum.dedup_hits, sum.dedup_misses);
+	seq_printf(s, "all_dedup_entries: %lu\n",
+			(unsigned long)atomic_long_read(&scull_dedup_entries));
+	seq_printf(s, "pool_hits: %lu\npool_misses: %lu\n",
+			READ_ONCE(dev->qpool.hits), READ_ONCE(dev->qpool.misses));
+
+	/* memory use against the caps; 0 means no cap */
+	seq_printf(s, "mem_used: %lu\nmem_limit: %lu\ncache: %i\n",
+			READ_ONCE(dev->nquanta) * READ_ONCE(dev->quantum),
+			READ_ONCE(dev->limit), READ_ONCE(dev->cache));
+	seq_printf(s, "all_mem_used: %lu\nall_mem_limit: %lu\n",
+			(unsigned long)atomic_long_read(&scull_mem_used),
+			READ_ONCE(scull_mem_limit));
+	seq_printf(s, "reclaimable: %lu\n", scull_reclaimable(dev));
+
+	/* the compressed tier: ratio is uncompressed over compressed size */
+	cold = READ_ONCE(dev->ncold);
+	cbytes = READ_ONCE(dev->cbytes);
+	ratio = cbytes ? cold * READ_ONCE(dev->quantum) * 100 / cbytes : 0;
+	seq_printf(s, "hot_quanta: %lu\ncold_quanta: %lu\n",
+			READ_ONCE(dev->nquanta) - cold, cold);
+	seq_printf(s, "cold_bytes: %lu\ncompression_ratio: %lu.%02lu\n",
+			cbytes, ratio / 100, ratio % 100);
+	return 0;
+}
+
+static int scull_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, scull_stats_show, inode->i_private);
+}
+
+static const struct file_operations scull_stats_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = scull_stats_open,
+	.read	 = seq_read,
+	.llseek	 = seq_lseek,
+	.release = single_release
+};
+
+/*
+ * Set up (and tear down) the counters of a device. A missing debugfs
+ * is not an error: the counters are still kept.
+ */
+int scull_stats_register(struct scull_dev *dev, const char *name)
+{
+	dev->stats = alloc_percpu(struct scull_stats);
+	if (!dev->stats)
+		return -ENOMEM;
+	if (scull_debugfs)
+		dev->debugfs = debugfs_create_file(name, S_IRUGO, scull_debugfs,
+				dev, &scull_stats_fops);
+	return 0;
+}
+
+void scull_stats_unregister(struct scull_dev *dev)
+{
+	debugfs_remove(dev->debugfs);	/* no problem if it is NULL */
+	dev->debugfs = NULL;
+	free_percpu(dev->stats);
+	dev->stats = NULL;
+}
+
+void scull_stats_init(void)
+{
+	scull_debugfs = debugfs_create_dir("scull", NULL);
+	if (IS_ERR(scull_debugfs))	/* no debugfs in this kernel */
+		scull_debugfs = NULL;
+}
+
+void scull_stats_cleanup(void)
+{
+	debugfs_remove_recursive(scull_debugfs);
+	scull_debugfs = NULL;
+}